@@ -1 +1 @@
-g++ -g -o  csv csv_manipulator.cpp --std=c++0x
+g++ -g -Wall -Wextra -o csv csv_manipulator.cpp --std=c++20 -pthread
@@ -2,6 +2,8 @@
 #define _COL_COMPUTE_
 
 #include <deque>
+#include <unordered_map>
+#include <mutex>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -10,10 +12,22 @@
 #include <string>
 #include <assert.h>
 #include "util.h"
+#include "schema.h"
+#include "sort.h"
+#include "distinct.h"
+#include "partition.h"
+#include "pipeline.h"
 
 using namespace std;
 namespace csv { namespace compute { 
 
+// A COMPUTE expression with its columns looked up in the header.
+struct ResolvedExpression {
+    char oper;
+    int index_a;
+    int index_b;
+};
+
 // COMPUTE expression specified by A+B 
 // Stack representation of the expression  ex:
 // 1 (A)
@@ -23,42 +37,49 @@ template <typename T>
 struct StackExpression {
     StackExpression (csv::util::CSVRecord<T>& record,
                      string& expression)
+        : StackExpression(record, Resolve(record.GetHeader(), expression))
+    {}
+
+    StackExpression (csv::util::CSVRecord<T>& record,
+                     const ResolvedExpression& resolved)
     {
+        if (resolved.oper) {
+            expr_stack_.push_back(string(1, resolved.oper));
+        }
+        expr_stack_.push_front(to_string(record[resolved.index_a]));
+        expr_stack_.push_back(to_string(record[resolved.index_b]));
+    }
+
+    // Exits if the expression is malformed or names
+    // a column not in the header.
+    static ResolvedExpression Resolve (csv::util::Header& header,
+                                       const string& expression) {
         // 2 columns with an operator in the middle
-        // Search for */+-
         // choose the operands from either side of the
         // operator
         std::vector<std::string> elems;
-        std::size_t found = expression.find('+');
-        if (found != string::npos) { 
-            expr_stack_.push_back("+");
-            csv::util::split(expression, '+', elems);
-        } else if ((found = expression.find('-')) != string::npos) {
-            expr_stack_.push_back("-");
-            csv::util::split(expression, '-', elems);
-        } else if ((found = expression.find('*')) != string::npos) {
-            expr_stack_.push_back("*");
-            csv::util::split(expression, '*', elems);
-        } else if ((found = expression.find('/')) != string::npos) {
-            expr_stack_.push_back("/");
-            csv::util::split(expression, '/', elems);
-        } 
-
-        int indexA = record.GetHeader().GetColumnIndex(elems[0]);
-        if (indexA < 0) {
+        ResolvedExpression resolved = {0, -1, -1};
+        char oper = 0;
+        if (csv::util::SplitExpression(expression, oper, elems)) {
+            resolved.oper = oper;
+        }
+        if (elems.size() < 2) {
+            cerr << "Invalid expression " << expression << ", expected <col_name><*,+,-,/><col_name>\n";
+            exit(0);
+        }
+
+        resolved.index_a = header.GetColumnIndex(elems[0]);
+        if (resolved.index_a < 0) {
             cerr <<"Column " << elems[0] << " was not found. Did you specify -h and not have a header in the file?\n";
             exit(0);
         }
 
-        int indexB = record.GetHeader().GetColumnIndex(elems[1]);
-        if (indexB < 0) {
+        resolved.index_b = header.GetColumnIndex(elems[1]);
+        if (resolved.index_b < 0) {
             cerr <<"Column " << elems[1] << " was not found. Did you specify -h and not have a header in the file?\n";
             exit(0);
         }
-
-        expr_stack_.push_front(to_string(record[indexA]));
-        expr_stack_.push_back(to_string(record[indexB]));
-
+        return resolved;
     }
     
     // Execute the rule specified in the stack
@@ -122,6 +143,10 @@ struct ColExprEval {
   ColExprEval(csv::util::CSVRecord<T>& rec) : rec_(rec){}
 
   csv::util::CSVRecord<T> eval (string& expression){
+      return eval(StackExpression<T>::Resolve(rec_.GetHeader(), expression));
+  }
+
+  csv::util::CSVRecord<T> eval (const ResolvedExpression& expression){
       shared_ptr<StackExpression<T>> expr_stack = make_shared<StackExpression<T>> (rec_, expression);
       shared_ptr<ExpressionEvaluator<T>> evaluator = make_shared<ExpressionEvaluator<T>>(expr_stack);
 
@@ -137,48 +162,468 @@ private:
 
 };
 
+// COMPUTE on files without a compiled layout, a CSVRecord
+// per row with the expression resolved at run time. The
+// expression is resolved, and a bad one exits, on the
+// constructing thread, before any map stage runs.
+struct DynamicEvaluator : public csv::pipeline::BatchEvaluator {
+    DynamicEvaluator (csv::util::Header& header,
+                      const string& compute_expression,
+                      csv::util::SimpleStringFilter& filter,
+                      char delimiter)
+        : header_(header), filter_(filter),
+          expression_(StackExpression<int>::Resolve(header_, compute_expression)),
+          delimiter_(delimiter)
+    {}
+
+    void Evaluate (const csv::pipeline::RecordBatch& batch,
+                   csv::pipeline::OutputChunk& chunk) const {
+        csv::util::Header header = header_;
+        csv::util::CSVRecord<int> record(header, filter_);
+        record.SetDelimiter(delimiter_);
+        for (auto &line : batch.records) {
+            record.ParseRecord(line);
+            // Do the desired computation on columns
+            std::shared_ptr<ColExprEval<int>> c = make_shared<ColExprEval<int>>(record);
+            csv::util::CSVRecord<int> result = c->eval(expression_);
+            // Filters the header as well, so take the
+            // record string first.
+            chunk.text += result.GetRecordString();
+            chunk.text.push_back('\n');
+            if (chunk.header.empty()) {
+                chunk.header = result.GetHeader().GetHeaderString();
+            }
+        }
+    }
+
+private:
+    csv::util::Header header_;
+    csv::util::SimpleStringFilter filter_;
+    ResolvedExpression expression_;
+    char delimiter_;
+};
+
+// Right hand (dimension) table of a join, held in memory
+// with its rows indexed by join key. Rows are kept as read,
+// only the key column is parsed.
+// Integer keys index an unordered_map. String keys are
+// dictionary encoded while the table is read, rows are then
+// indexed by the dense key id, and a probe costs one hash of
+// the left key plus a dictionary lookup.
+struct JoinTable {
+    // Reads the whole file, exits if the join column
+    // is not in it.
+    static shared_ptr<JoinTable> Load (const string& file_name,
+                                       const string& col_name,
+                                       bool has_header,
+                                       char delimiter = ',',
+                                       bool string_keys = false) {
+        string error;
+        shared_ptr<JoinTable> table = Get(file_name, col_name, has_header,
+                                          delimiter, string_keys, error);
+        if (!table) {
+            cerr << error;
+            exit(0);
+        }
+        return table;
+    }
+
+    // As Load, but returns null with the message in error.
+    // Tables are kept by file, join column and options, and
+    // reused while the file keeps its mtime and size, so a
+    // csv SERVE process parses a dimension file once. The
+    // file is parsed outside the lock, the cache is only
+    // locked to look up and store tables.
+    static shared_ptr<JoinTable> Get (const string& file_name,
+                                      const string& col_name,
+                                      bool has_header,
+                                      char delimiter,
+                                      bool string_keys,
+                                      string& error) {
+        char* real_path = realpath(file_name.c_str(), nullptr);
+        struct stat st;
+        if (!real_path || stat(real_path, &st) != 0) {
+            free(real_path);
+            error = "Could not open " + file_name + ".\n";
+            return nullptr;
+        }
+        string path(real_path);
+        free(real_path);
+
+        string key = path + '\0' + col_name + '\0' + delimiter +
+                     (has_header ? 'h' : '-') + (string_keys ? 's' : 'i');
+        {
+            lock_guard<mutex> lock(CacheMutex());
+            auto cached = Cache().find(key);
+            if (cached != Cache().end() && cached->second.Matches(st)) {
+                cached->second.last_used = ++CacheClock();
+                return cached->second.table;
+            }
+        }
+
+        shared_ptr<JoinTable> table = Read(file_name, col_name, has_header, delimiter, string_keys, error);
+        if (!table) {
+            return nullptr;
+        }
+
+        lock_guard<mutex> lock(CacheMutex());
+        CacheEntry& entry = Cache()[key];
+        entry.table = table;
+        entry.path = path;
+        entry.mtime = st.st_mtim;
+        entry.size = st.st_size;
+        entry.last_used = ++CacheClock();
+        Evict();
+        return table;
+    }
+
+    // Held while the cache changes. csv SERVE holds it to
+    // fork requests, so they never see a change half done.
+    static mutex& CacheMutex () {
+        static mutex cache_mutex;
+        return cache_mutex;
+    }
+
+    static shared_ptr<JoinTable> Read (const string& file_name,
+                                       const string& col_name,
+                                       bool has_header,
+                                       char delimiter,
+                                       bool string_keys,
+                                       string& error) {
+        ifstream file_read(file_name.c_str(), std::ifstream::in);
+        if (!file_read.is_open()) {
+            error = "Could not open " + file_name + ".\n";
+            return nullptr;
+        }
+
+        shared_ptr<JoinTable> table = make_shared<JoinTable>();
+        table->header.Read(file_read, file_name, has_header, delimiter);
+
+        table->key_index = table->header.GetColumnIndex(col_name);
+        if (table->key_index < 0) {
+            error = "Could not find column " + col_name + " in " + file_name + ".\n";
+            return nullptr;
+        }
+
+        table->string_keys = string_keys;
+        csv::util::Tokenizer tokenizer(delimiter);
+        vector<uint64_t> hashes;
+        string line;
+        string key_text;
+        while (tokenizer.ReadRecord(file_read, line)) {
+            csv::util::Slice key_field = tokenizer.Field(line.data(), line.size(), table->key_index);
+            if (string_keys) {
+                csv::util::Slice key = KeyText(key_field, tokenizer, key_text);
+                uint64_t hash = csv::util::HashKey(key.data, key.size);
+                size_t id = table->dictionary.Encode(key.data, key.size, hash);
+                if (id == table->id_index.size()) {
+                    table->id_index.push_back(vector<size_t>());
+                    hashes.push_back(hash);
+                }
+                table->id_index[id].push_back(table->rows.size());
+            } else {
+                int key = csv::util::ParseInt(key_field, tokenizer);
+                table->index[key].push_back(table->rows.size());
+            }
+            table->rows.push_back(make_pair(table->data.size(), line.size()));
+            table->data += line;
+        }
+
+        if (string_keys) {
+            table->filter.Reset(hashes.size());
+            for (auto &hash : hashes) {
+                table->filter.Add(hash);
+            }
+        } else {
+            table->filter.Reset(table->index.size());
+            for (auto &i : table->index) {
+                table->filter.Add(csv::util::HashInt(i.first));
+            }
+        }
+        return table;
+    }
+
+    // Rows whose key is the one in key_field,
+    // null if there are none.
+    const vector<size_t>* Find (const csv::util::Slice& key_field,
+                                const csv::util::Tokenizer& tokenizer,
+                                string& scratch) const {
+        if (!string_keys) {
+            return Find(csv::util::ParseInt(key_field, tokenizer));
+        }
+
+        csv::util::Slice key = KeyText(key_field, tokenizer, scratch);
+        uint64_t hash = csv::util::HashKey(key.data, key.size);
+        if (!filter.MayContain(hash)) {
+            return nullptr;
+        }
+        int id = dictionary.Find(key.data, key.size, hash);
+        return (id == csv::util::KeyDictionary::kNotFound) ? nullptr : &id_index[id];
+    }
+
+    // Rows with this integer key, null if there are none.
+    const vector<size_t>* Find (int key) const {
+        if (!filter.MayContain(csv::util::HashInt(key))) {
+            return nullptr;
+        }
+        unordered_map<int, vector<size_t>>::const_iterator it = index.find(key);
+        return (it == index.end()) ? nullptr : &it->second;
+    }
+
+    csv::util::Slice GetRow (size_t row) const {
+        csv::util::Slice slice = {data.data() + rows[row].first, rows[row].second};
+        return slice;
+    }
+
+    csv::util::Header header;
+    int key_index;
+    bool string_keys;
+    string data;                        // records back to back
+    vector<pair<size_t, size_t>> rows;  // offset, size in data
+    unordered_map<int, vector<size_t>> index;   // integer keys
+    csv::util::KeyDictionary dictionary;        // string keys
+    vector<vector<size_t>> id_index;            // rows by key id
+    csv::util::BloomFilter filter;
+
+private:
+    static const size_t kMaxCachedTables = 16;
+
+    struct CacheEntry {
+        // The file is still the one the table was read from.
+        bool Matches (const struct stat& st) const {
+            return mtime.tv_sec == st.st_mtim.tv_sec &&
+                   mtime.tv_nsec == st.st_mtim.tv_nsec && size == st.st_size;
+        }
+
+        shared_ptr<JoinTable> table;
+        string path;
+        struct timespec mtime;
+        off_t size;
+        uint64_t last_used;
+    };
+
+    static unordered_map<string, CacheEntry>& Cache () {
+        static unordered_map<string, CacheEntry> cache;
+        return cache;
+    }
+
+    static uint64_t& CacheClock () {
+        static uint64_t clock = 0;
+        return clock;
+    }
+
+    // Drop tables of files deleted or changed since, then the
+    // least recently used ones beyond kMaxCachedTables.
+    // Called with the cache locked.
+    static void Evict () {
+        unordered_map<string, CacheEntry>& cache = Cache();
+        for (auto it = cache.begin(); it != cache.end(); ) {
+            struct stat st;
+            if (stat(it->second.path.c_str(), &st) != 0 || !it->second.Matches(st)) {
+                it = cache.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        while (cache.size() > kMaxCachedTables) {
+            auto oldest = cache.begin();
+            for (auto it = cache.begin(); it != cache.end(); ++it) {
+                if (it->second.last_used < oldest->second.last_used) {
+                    oldest = it;
+                }
+            }
+            cache.erase(oldest);
+        }
+    }
+
+    // Key bytes of the field, unquoted into scratch when the
+    // field is quoted.
+    static csv::util::Slice KeyText (const csv::util::Slice& field,
+                                     const csv::util::Tokenizer& tokenizer,
+                                     string& scratch) {
+        if (field.size == 0 || field.data[0] != tokenizer.GetQuote()) {
+            return field;
+        }
+        scratch = tokenizer.Unquote(field);
+        csv::util::Slice key = {scratch.data(), scratch.size()};
+        return key;
+    }
+};
+
+// Output columns of one side of a join, the ones allowed
+// through the filter. Cells are copied from the input as
+// they are, a row which keeps every column and is already
+// comma separated is copied in one go.
+struct JoinProjection {
+    JoinProjection (csv::util::Header& header,
+                    csv::util::SimpleStringFilter& filter,
+                    char delimiter)
+        : tokenizer_(delimiter), keep_all_(delimiter == ','), num_allowed_(0) {
+        for (int i = 0; i < header.GetNumCols(); ++i) {
+            allow_.push_back(filter.Allow(header.GetColumnName(i)));
+            keep_all_ = keep_all_ && allow_.back();
+            num_allowed_ += allow_.back() ? 1 : 0;
+        }
+    }
+
+    // Append the row's allowed cells, each preceded by a
+    // comma. The comma in front of a row's first cell is
+    // not written out. Cells missing from a short row are 0,
+    // cells beyond the header are dropped, so the columns
+    // after the row stay aligned.
+    void Append (const csv::util::Slice& row, string& output) {
+        tokenizer_.Split(row.data, row.size, fields_);
+        if (keep_all_ && fields_.size() == allow_.size()) {
+            AppendCell(row.data, row.size, output);
+            return;
+        }
+
+        for (size_t i = 0; i < allow_.size(); ++i) {
+            if (!allow_[i]) {
+                continue;
+            }
+            if (i < fields_.size()) {
+                AppendField(fields_[i], output);
+            } else {
+                AppendCell("0", 1, output);
+            }
+        }
+    }
+
+    // Left outer join filler, a 0 per allowed column.
+    void AppendZeros (string& output) const {
+        for (int i = 0; i < num_allowed_; ++i) {
+            AppendCell("0", 1, output);
+        }
+    }
+
+private:
+    static void AppendCell (const char* cell, size_t size, string& output) {
+        output.push_back(',');
+        output.append(cell, size);
+    }
+
+    // A quoted field is valid CSV as it is. An unquoted one
+    // from input with another delimiter may hold a comma, a
+    // quote or a line break, and is quoted for the output.
+    void AppendField (const csv::util::Slice& field, string& output) const {
+        if (tokenizer_.GetDelimiter() == ',' ||
+            (field.size > 0 && field.data[0] == tokenizer_.GetQuote()) ||
+            !NeedsQuotes(field)) {
+            AppendCell(field.data, field.size, output);
+            return;
+        }
+        output.push_back(',');
+        output += csv::util::Tokenizer().Quote(string(field.data, field.size));
+    }
+
+    static bool NeedsQuotes (const csv::util::Slice& field) {
+        for (size_t i = 0; i < field.size; ++i) {
+            char c = field.data[i];
+            if (c == ',' || c == '"' || c == '\r' || c == '\n') {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    csv::util::Tokenizer tokenizer_;
+    vector<bool> allow_;
+    bool keep_all_;
+    int num_allowed_;
+    vector<csv::util::Slice> fields_;
+};
+
 // Evaluator
 // Bunch of static methods carrying out the main 
 // chunk of the work.
 struct CSVCompute {
+    // checkpoint_file_name - incremental mode. Only the records
+    // appended to the input since the checkpoint are evaluated,
+    // and appended to the output. A trailing line without its
+    // newline is left for the next run.
+    // partition - split the output on a column into several
+    // files, see PartitionedStreamBuf.
     static void Evaluate(string& input_file_name,
                          string& compute_expression,
                          string& filter_expression,
                          string& output_file_name,
-                         bool has_header = false) {
+                         bool has_header = false,
+                         const string& checkpoint_file_name = string(),
+                         char delimiter = ',',
+                         const csv::util::PartitionSpec& partition = csv::util::PartitionSpec()) {
+
+        bool incremental = !checkpoint_file_name.empty();
+        if (incremental && partition.Enabled()) {
+            cerr << "Incremental mode does not support partitioned output.\n";
+            exit(0);
+        }
+
+        csv::util::Checkpoint run;
+        run.input_file = input_file_name;
+        run.output_file = output_file_name;
+        run.expression = compute_expression;
+        run.filter = filter_expression;
+        run.delimiter = delimiter;
+        run.has_header = has_header;
+
+        // Anything else than the same command over the same,
+        // only appended to, input starts from scratch.
+        csv::util::Checkpoint checkpoint;
+        bool resume = incremental &&
+                      checkpoint.Load(checkpoint_file_name) &&
+                      checkpoint.SameRun(run) &&
+                      csv::util::FileSize(input_file_name) >= static_cast<int64_t>(checkpoint.offset) &&
+                      csv::util::FileSize(output_file_name) >= static_cast<int64_t>(checkpoint.output_size) &&
+                      checkpoint.fingerprint == csv::util::Checkpoint::Fingerprint(input_file_name, checkpoint.offset);
 
         ifstream csv_file_read(input_file_name.c_str(), std::ifstream::in);
-        ofstream csv_file_write(output_file_name);
+        if (resume) {
+            // Drop output of a run that died before
+            // saving its checkpoint.
+            if (truncate(output_file_name.c_str(), checkpoint.output_size) != 0) {
+                cerr << "Could not truncate " << output_file_name << " to resume.\n";
+                exit(0);
+            }
+        } else {
+            checkpoint = run;
+        }
+        csv::util::ResultOutput output(output_file_name, partition,
+                                       resume ? std::ofstream::app : std::ofstream::out);
+        ostream& csv_file_write = output.Stream();
 
         csv::util::Header header;
         if (csv_file_read.is_open()) {
             // read the column names if they are defined
-            if (has_header) {
-                string header_str;
-                // Get the header line
-                std::getline(csv_file_read, header_str);
-                header.set (header_str);
-            } else {
-                // No column header defined
-                // Generate default col names
-                header.MakeHeader (input_file_name);
-            }
+            header.Read(csv_file_read, input_file_name, has_header, delimiter);
 
             // Read the rest of the file
             csv::util::SimpleStringFilter filter(filter_expression);
-            csv::util::CSVRecord<int> record(header, filter);
-            bool header_written = false;
-            // stream every line into a record.
-            while (csv_file_read >> record) {
-                // Do the desired computation on columns
-                std::shared_ptr<ColExprEval<int>> c = make_shared<ColExprEval<int>>(record);
-                csv::util::CSVRecord<int> result = c->eval(compute_expression);
-                if (!header_written) {
-                    csv_file_write << result.GetHeader().GetHeaderString() << endl;
-                    header_written = true;
-                }
-                csv_file_write << result.GetRecordString() << endl;
+
+            if (!incremental) {
+                bool header_written = false;
+                EvaluateRecords(csv_file_read, header, compute_expression, filter,
+                                csv_file_write, has_header, header_written, delimiter);
+                output.Close();
+                return;
             }
+
+            int64_t start = resume ? checkpoint.offset : static_cast<int64_t>(csv_file_read.tellg());
+            int64_t end = csv::util::LastRecordEnd(input_file_name, start);
+            csv_file_read.seekg(start);
+
+            csv::util::LimitedStreamBuf tail_buf(csv_file_read.rdbuf(), end - start);
+            istream tail(&tail_buf);
+            EvaluateRecords(tail, header, compute_expression, filter,
+                            csv_file_write, has_header, checkpoint.header_written, delimiter);
+            output.Close();
+
+            checkpoint.fingerprint = csv::util::Checkpoint::Fingerprint(input_file_name, end);
+            checkpoint.offset = end;
+            checkpoint.rows += tail_buf.GetLines();
+            checkpoint.output_size = csv::util::FileSize(output_file_name);
+            checkpoint.Save(checkpoint_file_name);
         }
     }
 
@@ -189,94 +634,473 @@ struct CSVCompute {
                       string& col_name_left,
                       string& col_name_right,
                       bool has_header = false,
-                      bool is_outer = false) {
+                      bool is_outer = false,
+                      char delimiter = ',',
+                      const string& filter_expression = string(),
+                      bool string_keys = false,
+                      const csv::util::PartitionSpec& partition = csv::util::PartitionSpec()) {
+        vector<string> right_file_names(1, right_file_name);
+        vector<string> col_names_left(1, col_name_left);
+        vector<string> col_names_right(1, col_name_right);
+        StarJoin(left_file_name, right_file_names, output_file_name,
+                 col_names_left, col_names_right, has_header, is_outer,
+                 delimiter, filter_expression, string_keys, partition);
+    }
+
+    // Star join, one fact (left) file against several dimension
+    // (right) files, each with its own pair of join columns.
+    // All dimension tables are loaded and hashed up front, then
+    // the fact file is streamed once. A fact row matching
+    // several rows of a dimension yields one output row per
+    // combination. Left outer: a dimension without a match
+    // contributes 0 filled columns.
+    // Joined rows are never built, matches are (left row,
+    // right rows) and the output copies the cells of those
+    // rows that pass filter_expression.
+    // string_keys - join columns are compared as strings,
+    // otherwise as integers.
+    // partition - split the output on a column into several
+    // files, see PartitionedStreamBuf.
+    static void StarJoin (string& left_file_name,
+                          vector<string>& right_file_names,
+                          string& output_file_name,
+                          vector<string>& col_names_left,
+                          vector<string>& col_names_right,
+                          bool has_header = false,
+                          bool is_outer = false,
+                          char delimiter = ',',
+                          const string& filter_expression = string(),
+                          bool string_keys = false,
+                          const csv::util::PartitionSpec& partition = csv::util::PartitionSpec()) {
         ifstream left_file_read(left_file_name.c_str(), std::ifstream::in);
-        ifstream right_file_read(right_file_name.c_str(), std::ifstream::in);
-        ofstream output_file_write(output_file_name);
+        csv::util::ResultOutput result_output(output_file_name, partition);
+        ostream& output_file_write = result_output.Stream();
 
         csv::util::Header header_left;
         if (left_file_read.is_open()) {
             // read the column names if they are defined
-            if (has_header) {
-                string header_str;
-                // Get the header line
-                std::getline(left_file_read, header_str);
-                header_left.set (header_str);
-            } else {
-                // No column header defined
-                // Generate default col names
-                header_left.MakeHeader (left_file_name);
+            header_left.Read(left_file_read, left_file_name, has_header, delimiter);
+        }
+
+        size_t num_dims = right_file_names.size();
+        vector<shared_ptr<JoinTable>> dims;
+        vector<int> left_key_index;
+        for (size_t d = 0; d < num_dims; ++d) {
+            dims.push_back(JoinTable::Load(right_file_names[d], col_names_right[d],
+                                           has_header, delimiter, string_keys));
+
+            int index_col_left = header_left.GetColumnIndex(col_names_left[d]);
+            if (index_col_left < 0) {
+                cerr << "Could not find column " << col_names_left[d] << " in " << left_file_name << ".\n";
+                exit(0);
             }
+            left_key_index.push_back(index_col_left);
         }
 
-        csv::util::Header header_right;
-        if (right_file_read.is_open()) {
-            // read the column names if they are defined
-            if (has_header) {
-                string header_str;
-                // Get the header line
-                std::getline(right_file_read, header_str);
-                header_right.set (header_str);
-            } else {
-                // No column header defined
-                // Generate default col names
-                header_right.MakeHeader (right_file_name);
+        csv::util::SimpleStringFilter filter(filter_expression);
+        csv::util::Header header_out;
+        JoinProjection projection_left(header_left, filter, delimiter);
+        vector<JoinProjection> projection_right;
+        for (auto &column : header_left.GetColumnVector()) {
+            header_out.AddColumn(column.first);
+        }
+        for (auto &dim : dims) {
+            projection_right.push_back(JoinProjection(dim->header, filter, delimiter));
+            for (auto &column : dim->header.GetColumnVector()) {
+                header_out.AddColumn(column.first);
             }
         }
-        right_file_read.close(); 
+        header_out.ApplyFilter(filter);
+        string header_string = header_out.GetHeaderString();
+
+        // Batches of fact rows are joined on every core. The
+        // projections keep scratch space, each batch gets its
+        // own copies.
+        csv::util::Tokenizer tokenizer(delimiter);
+        auto join_batch = [&](const csv::pipeline::RecordBatch& batch,
+                              csv::pipeline::OutputChunk& chunk) {
+            JoinProjection batch_left = projection_left;
+            vector<JoinProjection> batch_right = projection_right;
+            vector<const vector<size_t>*> matches(num_dims);
+            vector<size_t> combination(num_dims);
+            string key_scratch;
+            string output_left;
+            string output;
+            for (auto &line : batch.records) {
+                // Probe every dimension on the join column alone,
+                // the rest of the row is not looked at unless they
+                // all matched.
+                bool drop = false;
+                for (size_t d = 0; d < num_dims && !drop; ++d) {
+                    matches[d] = dims[d]->Find(tokenizer.Field(line.data(), line.size(), left_key_index[d]),
+                                               tokenizer, key_scratch);
+                    drop = (matches[d] == nullptr && !is_outer);
+                }
+                if (drop) {
+                    continue;
+                }
 
-        // Join loop n^2 SimpleJoin
-        csv::util::CSVRecord<int> record_left(header_left);
+                csv::util::Slice row_left = {line.data(), line.size()};
+                output_left.clear();
+                batch_left.Append(row_left, output_left);
+
+                // Odometer over the matching rows of every dimension.
+                std::fill(combination.begin(), combination.end(), 0);
+                do {
+                    output = output_left;
+                    for (size_t d = 0; d < num_dims; ++d) {
+                        if (matches[d]) {
+                            batch_right[d].Append(dims[d]->GetRow((*matches[d])[combination[d]]), output);
+                        } else {
+                            batch_right[d].AppendZeros(output);
+                        }
+                    }
+                    output.push_back('\n');
+                    size_t skip = (output[0] == ',') ? 1 : 0;
+                    chunk.text.append(output, skip, string::npos);
+                } while (NextCombination(matches, combination));
+            }
+            chunk.header = header_string;
+        };
+
+        // Written with the first joined row, like the
+        // other commands.
         bool header_written = false;
-        while (left_file_read >> record_left) {
-            csv::util::CSVRecord<int> record_right(header_right);
-            // reset stream of the "right" file
-            ifstream right_file_join_read(right_file_name.c_str(), std::ifstream::in);
-            // Skip the header if specified
-            if (has_header) {
-                string header_str;
-                // Get the header line
-                std::getline(right_file_join_read, header_str);
+        csv::pipeline::RunStages(left_file_read, tokenizer, join_batch,
+                                 output_file_write, header_written);
+        result_output.Close();
+    }
+
+    // SORT on one or more integer key columns, key_expression
+    // is a comma separated list of column names, most
+    // significant first. Ties keep their input order.
+    // The input is mapped, only (key, row offset) entries are
+    // sorted and rows are copied to the output as they are.
+    // memory_budget bounds the entries held in memory, beyond
+    // it sorted runs are spilled next to the output and merged.
+    static void Sort (string& input_file_name,
+                      string& output_file_name,
+                      string& key_expression,
+                      bool has_header = false,
+                      char delimiter = ',',
+                      size_t memory_budget = 1024 * 1024 * 1024,
+                      size_t num_threads = 0) {
+        csv::util::MappedFile input(input_file_name);
+        if (!input.IsOpen()) {
+            cerr << "Could not open " << input_file_name << ".\n";
+            exit(0);
+        }
+
+        if (num_threads == 0) {
+            num_threads = std::max<unsigned>(1, thread::hardware_concurrency());
+        }
+
+        csv::util::Tokenizer tokenizer(delimiter);
+        const char* data = input.Data();
+        size_t size = input.Size();
+
+        csv::util::Header header;
+        size_t body_start = 0;
+        if (has_header) {
+            body_start = tokenizer.FindRecordEnd(data, size);
+            header.set (string(data, body_start), delimiter);
+        } else {
+            header.MakeHeader (input_file_name, delimiter);
+        }
+
+        vector<string> key_names;
+        csv::util::split(key_expression, ',', key_names);
+        vector<int> key_index;
+        for (auto &key_name : key_names) {
+            int index = header.GetColumnIndex(key_name);
+            if (index < 0) {
+                cerr << "Could not find column " << key_name << " in " << input_file_name << ".\n";
+                exit(0);
             }
- 
-            bool match = false;
-            while (right_file_join_read >> record_right) {
-                csv::util::CSVRecord<int> result = record_left.Join(record_right, col_name_left, col_name_right);
-
-                if (!header_written) {
-                    output_file_write << result.GetHeader().GetHeaderString() << endl;
-                    header_written = true;
-                }
-                
-                string result_str = result.GetRecordString();
-                if (!result_str.empty()) {
-                    match = true;
-                    output_file_write << result.GetRecordString() << endl;
+            key_index.push_back(index);
+        }
+        if (key_index.empty()) {
+            cerr << "Specify the sort columns.\n";
+            exit(0);
+        }
+
+        ofstream output_file_write(output_file_name, std::ofstream::binary);
+        if (has_header) {
+            WriteRow(output_file_write, data, body_start);
+        }
+
+        csv::sort::ExternalSort sorter(key_index.size(), memory_budget, num_threads,
+                                       output_file_name + ".run");
+
+        // Record aligned chunks, num_threads of them at a time.
+        const size_t kChunkSize = 64 * 1024 * 1024;
+        size_t body_size = size - body_start;
+        vector<size_t> chunks = tokenizer.ChunkBoundaries(
+            data + body_start, body_size, std::max(num_threads, body_size / kChunkSize + 1));
+
+        vector<vector<uint32_t>> entries(num_threads);
+        for (size_t first = 0; first + 1 < chunks.size(); first += num_threads) {
+            size_t group = std::min(num_threads, chunks.size() - 1 - first);
+            csv::util::RunParallel(group, [&](size_t g) {
+                entries[g].clear();
+                ExtractSortKeys(tokenizer, data + body_start, body_start,
+                                chunks[first + g], chunks[first + g + 1], key_index, entries[g]);
+            });
+
+            for (size_t g = 0; g < group; ++g) {
+                sorter.Add(entries[g]);
+            }
+        }
+
+        sorter.Merge([&](uint64_t offset, uint32_t length) {
+            WriteRow(output_file_write, data + offset, length);
+        });
+    }
+
+    // DISTINCT, drop rows whose key came earlier in the input.
+    // filter_expression selects the key columns, the whole row
+    // is the key without it, rows are written as they are.
+    // The input is mapped, (hash, row offset) entries are
+    // collected on num_threads threads into hash partitions,
+    // which are then deduplicated num_threads at a time.
+    // memory_budget bounds the entries held in memory, beyond
+    // it partitions are spilled next to the output.
+    // keep_order - rows come out in input order, otherwise
+    // grouped by partition.
+    static void Distinct (string& input_file_name,
+                          string& output_file_name,
+                          string& filter_expression,
+                          bool has_header = false,
+                          char delimiter = ',',
+                          size_t memory_budget = 1024 * 1024 * 1024,
+                          size_t num_threads = 0,
+                          bool keep_order = false) {
+        csv::util::MappedFile input(input_file_name);
+        if (!input.IsOpen()) {
+            cerr << "Could not open " << input_file_name << ".\n";
+            exit(0);
+        }
+
+        if (num_threads == 0) {
+            num_threads = std::max<unsigned>(1, thread::hardware_concurrency());
+        }
+
+        csv::util::Tokenizer tokenizer(delimiter);
+        const char* data = input.Data();
+        size_t size = input.Size();
+
+        csv::util::Header header;
+        size_t body_start = 0;
+        if (has_header) {
+            body_start = tokenizer.FindRecordEnd(data, size);
+            header.set (string(data, body_start), delimiter);
+        } else {
+            header.MakeHeader (input_file_name, delimiter);
+        }
+
+        vector<int> key_index;
+        if (!filter_expression.empty()) {
+            csv::util::SimpleStringFilter filter(filter_expression);
+            for (int i = 0; i < header.GetNumCols(); ++i) {
+                if (filter.Allow(header.GetColumnName(i))) {
+                    key_index.push_back(i);
                 }
             }
+            if (key_index.empty()) {
+                cerr << "Could not find columns " << filter_expression << " in " << input_file_name << ".\n";
+                exit(0);
+            }
+        }
+        csv::distinct::RowKey row_key(tokenizer, key_index);
+
+        ofstream output_file_write(output_file_name, std::ofstream::binary);
+        if (has_header) {
+            WriteRow(output_file_write, data, body_start);
+        }
+
+        // Hash every row into partitions, num_threads record
+        // aligned chunks at a time.
+        typedef csv::distinct::PartitionedEntries Partitions;
+        Partitions partitions(memory_budget, output_file_name + ".distinct");
+        const size_t kChunkSize = 64 * 1024 * 1024;
+        size_t body_size = size - body_start;
+        vector<size_t> chunks = tokenizer.ChunkBoundaries(
+            data + body_start, body_size, std::max(num_threads, body_size / kChunkSize + 1));
+
+        vector<vector<vector<csv::distinct::RowEntry>>> chunk_entries(
+            num_threads, vector<vector<csv::distinct::RowEntry>>(Partitions::kNumPartitions));
+        for (size_t first = 0; first + 1 < chunks.size(); first += num_threads) {
+            size_t group = std::min(num_threads, chunks.size() - 1 - first);
+            csv::util::RunParallel(group, [&](size_t g) {
+                HashRows(tokenizer, row_key, data + body_start, body_start,
+                         chunks[first + g], chunks[first + g + 1], chunk_entries[g]);
+            });
+
+            for (size_t g = 0; g < group; ++g) {
+                partitions.Add(chunk_entries[g]);
+            }
+        }
+        chunk_entries.clear();
 
-            // If there is no match in the rhs file
-            // add a NULL record in its place for a
-            // left outer join result.
-            if (!match && is_outer) {
-                csv::util::CSVRecord<int> result;
-                csv::util::CSVRecord<int> empty_right(header_right,0);
-                csv::util::CSVRecord<int> left = record_left;
-                result = left + empty_right;
-
-                if (!header_written) {
-                    output_file_write << result.GetHeader().GetHeaderString() << endl;
-                    header_written = true;
+        // Deduplicate num_threads partitions at a time, then
+        // write them in partition order, or feed them to a sort
+        // on row offset to restore the input order.
+        csv::sort::ExternalSort order(2, memory_budget, num_threads, output_file_name + ".run");
+        vector<vector<csv::distinct::RowEntry>> entries(num_threads);
+        size_t num_partitions = Partitions::kNumPartitions;
+        for (size_t first = 0; first < num_partitions; first += num_threads) {
+            size_t group = std::min(num_threads, num_partitions - first);
+            csv::util::RunParallel(group, [&](size_t g) {
+                vector<csv::util::Slice> fields_a, fields_b;
+                string scratch_a, scratch_b;
+                partitions.Load(first + g, entries[g]);
+                csv::distinct::Dedupe(entries[g], [&](const csv::distinct::RowEntry& a,
+                                                      const csv::distinct::RowEntry& b) {
+                    return row_key.Equal(data + a.offset, a.length, data + b.offset, b.length,
+                                         fields_a, fields_b, scratch_a, scratch_b);
+                });
+            });
+
+            for (size_t g = 0; g < group; ++g) {
+                if (!keep_order) {
+                    for (auto &entry : entries[g]) {
+                        WriteRow(output_file_write, data + entry.offset, entry.length);
+                    }
+                    continue;
                 }
-                
-                string result_str = result.GetRecordString();
-                if (!result_str.empty()) {
-                    output_file_write << result.GetRecordString() << endl;
+
+                // Sort keys are the offset, high word first.
+                vector<uint32_t> offsets;
+                for (auto &entry : entries[g]) {
+                    offsets.push_back(static_cast<uint32_t>(entry.offset >> 32));
+                    offsets.push_back(static_cast<uint32_t>(entry.offset));
+                    offsets.push_back(static_cast<uint32_t>(entry.offset));
+                    offsets.push_back(static_cast<uint32_t>(entry.offset >> 32));
+                    offsets.push_back(entry.length);
                 }
+                order.Add(offsets);
             }
-            match = false;
-            right_file_join_read.close();
         }
+
+        if (keep_order) {
+            order.Merge([&](uint64_t offset, uint32_t length) {
+                WriteRow(output_file_write, data + offset, length);
+            });
+        }
+    }
+
+private:
+    // Entries of the records in [begin, end) of body by
+    // partition, offsets are made relative to the file with
+    // base. Blank lines are dropped.
+    static void HashRows (const csv::util::Tokenizer& tokenizer,
+                          const csv::distinct::RowKey& row_key,
+                          const char* body, size_t base,
+                          size_t begin, size_t end,
+                          vector<vector<csv::distinct::RowEntry>>& partitions) {
+        for (auto &partition : partitions) {
+            partition.clear();
+        }
+
+        vector<csv::util::Slice> fields;
+        string scratch;
+        for (size_t pos = begin; pos < end;) {
+            size_t record_size = tokenizer.FindRecordEnd(body + pos, end - pos);
+            size_t length = record_size;
+            while (length && (body[pos + length - 1] == '\n' || body[pos + length - 1] == '\r')) {
+                length--;
+            }
+
+            if (length) {
+                csv::distinct::RowEntry entry;
+                entry.hash = row_key.Hash(body + pos, length, fields, scratch);
+                entry.offset = base + pos;
+                entry.length = static_cast<uint32_t>(length);
+                partitions[csv::distinct::PartitionedEntries::Partition(entry.hash)].push_back(entry);
+            }
+            pos += record_size;
+        }
+    }
+
+    // Sort entries of the records in [begin, end) of body,
+    // offsets are made relative to the file with base.
+    static void ExtractSortKeys (const csv::util::Tokenizer& tokenizer,
+                                 const char* body, size_t base,
+                                 size_t begin, size_t end,
+                                 const vector<int>& key_index,
+                                 vector<uint32_t>& entries) {
+        vector<csv::util::Slice> fields;
+        for (size_t pos = begin; pos < end;) {
+            size_t record_size = tokenizer.FindRecordEnd(body + pos, end - pos);
+            size_t length = record_size;
+            while (length && (body[pos + length - 1] == '\n' || body[pos + length - 1] == '\r')) {
+                length--;
+            }
+
+            // Blank lines are dropped.
+            if (length) {
+                tokenizer.Split(body + pos, length, fields);
+                for (auto &index : key_index) {
+                    int key = (static_cast<size_t>(index) < fields.size()) ?
+                              csv::util::ParseInt(fields[index], tokenizer) : 0;
+                    entries.push_back(csv::sort::BiasKey(key));
+                }
+                uint64_t offset = base + pos;
+                entries.push_back(static_cast<uint32_t>(offset));
+                entries.push_back(static_cast<uint32_t>(offset >> 32));
+                entries.push_back(static_cast<uint32_t>(length));
+            }
+            pos += record_size;
+        }
+    }
+
+    // Row as it is in the input, newline terminated.
+    static void WriteRow (ofstream& output_file_write, const char* row, size_t length) {
+        while (length && (row[length - 1] == '\n' || row[length - 1] == '\r')) {
+            length--;
+        }
+        output_file_write.write(row, length);
+        output_file_write.put('\n');
+    }
+
+    // Step to the next combination of matching rows,
+    // false after the last one.
+    static bool NextCombination (const vector<const vector<size_t>*>& matches,
+                                 vector<size_t>& combination) {
+        for (size_t d = combination.size(); d-- > 0;) {
+            if (matches[d] && ++combination[d] < matches[d]->size()) {
+                return true;
+            }
+            combination[d] = 0;
+        }
+        return false;
+    }
+
+    // Evaluate every record of the stream, writing the header
+    // before the first one unless header_written.
+    static void EvaluateRecords (istream& csv_file_read,
+                                 csv::util::Header& header,
+                                 string& compute_expression,
+                                 csv::util::SimpleStringFilter& filter,
+                                 ostream& csv_file_write,
+                                 bool has_header,
+                                 bool& header_written,
+                                 char delimiter) {
+        // Known layouts take the compiled path.
+        shared_ptr<csv::pipeline::BatchEvaluator> evaluator;
+        if (has_header) {
+            evaluator = csv::schema::KnownSchemas::Make(header, compute_expression, filter, delimiter);
+        }
+        if (!evaluator) {
+            evaluator = make_shared<DynamicEvaluator>(header, compute_expression, filter, delimiter);
+        }
+
+        csv::pipeline::RunStages(csv_file_read, csv::util::Tokenizer(delimiter),
+                                 [&](const csv::pipeline::RecordBatch& batch,
+                                     csv::pipeline::OutputChunk& chunk) {
+                                     evaluator->Evaluate(batch, chunk);
+                                 },
+                                 csv_file_write, header_written);
     }
 };
 
@@ -3,6 +3,7 @@
 #include <getopt.h>
 #include "util.h"
 #include "col_compute.h"
+#include "server.h"
 
 void ShowUsage(){
       cerr << "Usage: csv COMPUTE "
@@ -11,6 +12,10 @@ void ShowUsage(){
           << "\t-o,--output <FileName>\t\t Result of computation go into this file.\n"
           << "\t-e,--expr <col_name><*,+,-,/><col_name> \t\tSpecify the compute expressioni\t\t\n"
           << "\t-h,--with_header \t\tThere is a header present in the input file\t\t\n"
+          << "\t-c,--checkpoint <FileName> \t\tIncremental mode, only evaluate rows appended since the checkpoint and append them to the output\t\t\n"
+          << "\t-d,--delimiter <char> \t\tField delimiter of the input, default is ,\t\t\n"
+          << "\t-p,--partition-by <col_name> \t\tSplit the output on this column into <output>_part<k> files\t\t\n"
+          << "\t-n,--partitions <count> \t\tNumber of partition files\t\t\n"
           << std::endl;
 }
 
@@ -24,26 +29,71 @@ void ShowJoinUsage(){
           << "\t-o,--output_file <FileName> \t\tSpecify the output file name.\t\t\n"
           << "\t-h,--with_header \t\tThere is a header present in the input file\t\t\n"
           << "\t-t,--type <type> \t\tSpecify join type inner or outer, default is inner.\t\t\n"
+          << "\t-d,--delimiter <char> \t\tField delimiter of the input files, default is ,\t\t\n"
+          << "\t-f,--filter <col_name>[,<col_name>...] \t\tOnly output these columns\t\t\n"
+          << "\t-s,--string_keys \t\tCompare the join columns as strings instead of integers\t\t\n"
+          << "\t-p,--partition-by <col_name> \t\tSplit the output on this column into <output>_part<k> files\t\t\n"
+          << "\t-n,--partitions <count> \t\tNumber of partition files\t\t\n"
+          << "\tRepeat -r, -u and -v to star join the left file with several right files in one pass.\n"
           << std::endl;
 }
 
+// -p and -n go together.
+csv::util::PartitionSpec GetPartitionSpec(const string& col_name, int num_partitions) {
+    csv::util::PartitionSpec partition;
+    if (col_name.empty() && num_partitions == 0) {
+        return partition;
+    }
+    if (col_name.empty() || num_partitions <= 0) {
+        cerr << "Specify both the partition column -p and a partition count -n above 0.\n";
+        exit(0);
+    }
+    partition.col_name = col_name;
+    partition.num_partitions = num_partitions;
+    return partition;
+}
 
- 
-int main(int argc, char **argv) {
+void ShowSortUsage(){
+      cerr << "Usage: csv SORT "
+          << "Options:\n"
+          << "\t-i,--input <FileName>\t\tInput CSV file\n"
+          << "\t-o,--output <FileName>\t\tSorted rows go into this file.\n"
+          << "\t-k,--keys <col_name>[,<col_name>...] \t\tInteger columns to sort on, most significant first\t\t\n"
+          << "\t-h,--with_header \t\tThere is a header present in the input file\t\t\n"
+          << "\t-d,--delimiter <char> \t\tField delimiter of the input, default is ,\t\t\n"
+          << "\t-m,--memory <MB> \t\tMemory for sorting, sorted runs are spilled to disk beyond it. Default is 1024\t\t\n"
+          << "\t-t,--threads <count> \t\tSorting threads, default is one per core\t\t\n"
+          << std::endl;
+}
 
-///////// OPTION PROCESSING////
+void ShowDistinctUsage(){
+      cerr << "Usage: csv DISTINCT "
+          << "Options:\n"
+          << "\t-i,--input <FileName>\t\tInput CSV file\n"
+          << "\t-o,--output <FileName>\t\tRows without duplicates go into this file.\n"
+          << "\t-f,--filter <col_name>[,<col_name>...] \t\tCompare rows on these columns only, the first row of each is kept\t\t\n"
+          << "\t-h,--with_header \t\tThere is a header present in the input file\t\t\n"
+          << "\t-d,--delimiter <char> \t\tField delimiter of the input, default is ,\t\t\n"
+          << "\t-s,--keep_order \t\tWrite rows in input order (a stable DISTINCT), otherwise they are grouped by hash\t\t\n"
+          << "\t-m,--memory <MB> \t\tMemory for hashing, partitions are spilled to disk beyond it. Default is 1024\t\t\n"
+          << "\t-t,--threads <count> \t\tHashing threads, default is one per core\t\t\n"
+          << std::endl;
+}
 
-  int c;
-  
-  // This tool has 2 main categories
-  // COMPUTE and JOIN
-  if (argc < 2) {
-      ShowUsage();
-      ShowJoinUsage();
-      exit(0);
-  }
+void ShowServeUsage(){
+      cerr << "Usage: csv SERVE "
+          << "Options:\n"
+          << "\t-S,--socket <path>\t\tUnix socket to listen on. Dimension tables of JOIN requests stay parsed in memory between requests.\n"
+          << "\tCOMPUTE, JOIN, SORT and DISTINCT take --server <path> to run in a SERVE process instead.\n"
+          << std::endl;
+}
 
-  if (!strcmp(argv[1], "JOIN")) {
+// Options of csv JOIN.
+struct JoinOptions {
+    JoinOptions ()
+        : num_partitions(0), has_header(false), is_outer_join(false),
+          string_keys(false), delimiter(',')
+    {}
 
     string lf;
     string rf;
@@ -51,9 +101,21 @@ int main(int argc, char **argv) {
     string lc;
     string rc;
     string type;
-    bool has_header = false;
-    bool is_outer_join = false;
- 
+    string filter_exp;
+    string partition_col;
+    int num_partitions;
+    // -r, -u and -v repeat for star joins
+    vector<string> right_files;
+    vector<string> left_cols;
+    vector<string> right_cols;
+    bool has_header;
+    bool is_outer_join;
+    bool string_keys;
+    char delimiter;
+};
+
+// Read the JOIN options, false on an unknown one.
+bool ParseJoinOptions(int argc, char **argv, JoinOptions& options) {
     while (1) {
       static struct option long_options[] =
         {
@@ -64,13 +126,18 @@ int main(int argc, char **argv) {
           {"right_col", required_argument, 0, 'v'},
           {"join", required_argument, 0, 'j'},
           {"with_header", no_argument, 0, 'h'},
+          {"delimiter", required_argument, 0, 'd'},
+          {"filter", required_argument, 0, 'f'},
+          {"string_keys", no_argument, 0, 's'},
+          {"partition-by", required_argument, 0, 'p'},
+          {"partitions", required_argument, 0, 'n'},
           {0,0,0,0},
         };
       /* getopt_long stores the option index here. */
       int option_index = 0;
 
 
-      c = getopt_long (argc, argv, "l:r:o:u:v:hj:",
+      int c = getopt_long (argc, argv, "l:r:o:u:v:hj:d:f:sp:n:",
                        long_options, &option_index);
 
       /* Detect the end of the options. */
@@ -79,65 +146,145 @@ int main(int argc, char **argv) {
 
       switch (c) {
         case 'l':
-          lf = optarg;
+          options.lf = optarg;
           break;
 
         case 'r':
-          rf = optarg;
+          options.rf = optarg;
+          options.right_files.push_back(options.rf);
           break;
 
         case 'u':
-          lc = optarg;
+          options.lc = optarg;
+          options.left_cols.push_back(options.lc);
           break;
 
         case 'v':
-          rc = optarg;
+          options.rc = optarg;
+          options.right_cols.push_back(options.rc);
           break;
 
         case 'o':
-          of = optarg;
+          options.of = optarg;
+          break;
+
+        case 'd':
+          options.delimiter = optarg[0];
+          break;
+
+        case 'f':
+          options.filter_exp = optarg;
+          break;
+
+        case 's':
+          options.string_keys = true;
+          break;
+
+        case 'p':
+          options.partition_col = optarg;
+          break;
+
+        case 'n':
+          options.num_partitions = atoi(optarg);
           break;
 
        case 'j':
-          type = optarg;
+          options.type = optarg;
           
-          if (type == "outer"){
-              is_outer_join = true;
+          if (options.type == "outer"){
+              options.is_outer_join = true;
           }
+          break;
 
        case 'h':
-          has_header = true;
+          options.has_header = true;
           break;
 
-         break;
-
         default:
-          ShowJoinUsage();
-          abort ();
+          return false;
         }
     }
+    return true;
+}
 
-    if (lf.empty()) {
+// SERVE: a job parsing the right files of a JOIN request
+// into the table cache, run in the background so the
+// requests after it find them loaded. Options are parsed
+// here, on the server's thread, the job gets absolute paths.
+csv::server::WarmJob PrepareWarm(const string& cwd, int argc, char **argv) {
+    JoinOptions options;
+    if (strcmp(argv[1], "JOIN") || !ParseJoinOptions(argc, argv, options)) {
+        return nullptr;
+    }
+
+    for (auto &file : options.right_files) {
+        file = csv::server::AbsolutePath(cwd, file);
+    }
+    return [options] {
+        for (size_t i = 0; i < options.right_files.size() && i < options.right_cols.size(); ++i) {
+            string error;
+            csv::compute::JoinTable::Get(options.right_files[i], options.right_cols[i], options.has_header,
+                                         options.delimiter, options.string_keys, error);
+        }
+    };
+}
+
+// Run one COMPUTE, JOIN, SORT or DISTINCT command line.
+void RunCommand(int argc, char **argv) {
+
+///////// OPTION PROCESSING////
+
+  int c;
+
+  if (!strcmp(argv[1], "JOIN")) {
+
+    JoinOptions options;
+    if (!ParseJoinOptions(argc, argv, options)) {
+        ShowJoinUsage();
+        abort ();
+    }
+
+    if (options.lf.empty()) {
         cerr << "Specify left file\n";
         exit(0);
-    } else if (rf.empty()) {
+    } else if (options.rf.empty()) {
         cerr << "Specify right file\n";
         exit(0);
-    } else if (of.empty()) {
+    } else if (options.of.empty()) {
         cerr << "Specify output file \n";
         exit(0);
-    } else if (lc.empty()) {
+    } else if (options.lc.empty()) {
         cerr << "SPecify left-column name -lc. \n";
         exit (0);
-    } else if (rc.empty()) {
+    } else if (options.rc.empty()) {
         cerr << "Specify right column in the join -rc \n";
         exit(0);
-    } else if (type.empty()) {
+    } else if (options.type.empty()) {
         cerr << "Specify Join type, otherwise the tool will assume its an inner join\n";
         exit(0);
     }
 
-    csv::compute::CSVCompute::Join(lf, rf, of, lc, rc, has_header,is_outer_join);
+    csv::util::PartitionSpec partition = GetPartitionSpec(options.partition_col, options.num_partitions);
+    if (options.right_files.size() > 1) {
+        // A single left column joins every right file.
+        if (options.left_cols.size() == 1) {
+            options.left_cols.resize(options.right_files.size(), options.lc);
+        }
+
+        if (options.left_cols.size() != options.right_files.size() ||
+            options.right_cols.size() != options.right_files.size()) {
+            cerr << "Specify one -u and one -v per right file\n";
+            exit(0);
+        }
+        csv::compute::CSVCompute::StarJoin(options.lf, options.right_files, options.of,
+                                           options.left_cols, options.right_cols,
+                                           options.has_header, options.is_outer_join, options.delimiter,
+                                           options.filter_exp, options.string_keys, partition);
+    } else {
+        csv::compute::CSVCompute::Join(options.lf, options.rf, options.of, options.lc, options.rc,
+                                       options.has_header, options.is_outer_join, options.delimiter,
+                                       options.filter_exp, options.string_keys, partition);
+    }
   } else if (!strcmp(argv[1], "COMPUTE")) {
 
       string input_file; 
@@ -145,7 +292,11 @@ int main(int argc, char **argv) {
       string compute_exp;
       string filter_exp;
       string with_header;
+      string checkpoint_file;
+      string partition_col;
+      int num_partitions = 0;
       bool has_header = false;
+      char delimiter = ',';
  
       while (1) {
           static struct option long_options[] =
@@ -155,12 +306,16 @@ int main(int argc, char **argv) {
               {"input", required_argument, 0, 'i'},
               {"output", required_argument, 0, 'o'},
               {"with_header", no_argument, 0, 'h'},
+              {"checkpoint", required_argument, 0, 'c'},
+              {"delimiter", required_argument, 0, 'd'},
+              {"partition-by", required_argument, 0, 'p'},
+              {"partitions", required_argument, 0, 'n'},
               {0,0,0,0},
           };
           /* getopt_long stores the option index here. */
           int option_index = 0;
 
-          c = getopt_long (argc, argv, "e:f:j:i:o:h",
+          c = getopt_long (argc, argv, "e:f:j:i:o:hc:d:p:n:",
               long_options, &option_index);
 
           /* Detect the end of the options. */
@@ -188,6 +343,22 @@ int main(int argc, char **argv) {
                   has_header = true;
                   break;
 
+              case 'c':
+                  checkpoint_file = optarg;
+                  break;
+
+              case 'd':
+                  delimiter = optarg[0];
+                  break;
+
+              case 'p':
+                  partition_col = optarg;
+                  break;
+
+              case 'n':
+                  num_partitions = atoi(optarg);
+                  break;
+
               default:
                   cerr << "Usage: "
                       << "Options:\n"  
@@ -211,15 +382,244 @@ int main(int argc, char **argv) {
           exit(0);
       }
       // Perform evaluation on the CSV file.
-      csv::compute::CSVCompute::Evaluate(input_file, compute_exp, filter_exp, output_file, has_header);
+      csv::compute::CSVCompute::Evaluate(input_file, compute_exp, filter_exp, output_file, has_header, checkpoint_file, delimiter,
+                                         GetPartitionSpec(partition_col, num_partitions));
+  } else if (!strcmp(argv[1], "SORT")) {
+
+      string input_file;
+      string output_file;
+      string key_exp;
+      bool has_header = false;
+      char delimiter = ',';
+      size_t memory_mb = 1024;
+      size_t num_threads = 0;
+
+      while (1) {
+          static struct option long_options[] =
+          {
+              {"input", required_argument, 0, 'i'},
+              {"output", required_argument, 0, 'o'},
+              {"keys", required_argument, 0, 'k'},
+              {"with_header", no_argument, 0, 'h'},
+              {"delimiter", required_argument, 0, 'd'},
+              {"memory", required_argument, 0, 'm'},
+              {"threads", required_argument, 0, 't'},
+              {0,0,0,0},
+          };
+          /* getopt_long stores the option index here. */
+          int option_index = 0;
+
+          c = getopt_long (argc, argv, "i:o:k:hd:m:t:",
+              long_options, &option_index);
+
+          /* Detect the end of the options. */
+          if (c == -1)
+              break;
+
+          switch (c) {
+              case 'i':
+                  input_file = optarg;
+                  break;
+
+              case 'o':
+                  output_file = optarg;
+                  break;
+
+              case 'k':
+                  key_exp = optarg;
+                  break;
+
+              case 'h':
+                  has_header = true;
+                  break;
+
+              case 'd':
+                  delimiter = optarg[0];
+                  break;
+
+              case 'm':
+                  memory_mb = atoi(optarg);
+                  break;
+
+              case 't':
+                  num_threads = atoi(optarg);
+                  break;
+
+              default:
+                  ShowSortUsage();
+                  exit (0);
+          }
+      }
+
+      if (input_file.empty()) {
+          cerr << "Specify input file. \n";
+          exit(0);
+      } else if (output_file.empty()) {
+          cerr << "Specify output file \n";
+          exit(0);
+      } else if (key_exp.empty()) {
+          cerr << "Specify the sort columns -k. \n";
+          exit(0);
+      }
+
+      csv::compute::CSVCompute::Sort(input_file, output_file, key_exp, has_header, delimiter,
+                                     std::max<size_t>(1, memory_mb) * 1024 * 1024, num_threads);
+  } else if (!strcmp(argv[1], "DISTINCT")) {
+
+      string input_file;
+      string output_file;
+      string filter_exp;
+      bool has_header = false;
+      bool keep_order = false;
+      char delimiter = ',';
+      size_t memory_mb = 1024;
+      size_t num_threads = 0;
+
+      while (1) {
+          static struct option long_options[] =
+          {
+              {"input", required_argument, 0, 'i'},
+              {"output", required_argument, 0, 'o'},
+              {"filter", required_argument, 0, 'f'},
+              {"with_header", no_argument, 0, 'h'},
+              {"delimiter", required_argument, 0, 'd'},
+              {"keep_order", no_argument, 0, 's'},
+              {"memory", required_argument, 0, 'm'},
+              {"threads", required_argument, 0, 't'},
+              {0,0,0,0},
+          };
+          /* getopt_long stores the option index here. */
+          int option_index = 0;
+
+          c = getopt_long (argc, argv, "i:o:f:hd:sm:t:",
+              long_options, &option_index);
+
+          /* Detect the end of the options. */
+          if (c == -1)
+              break;
+
+          switch (c) {
+              case 'i':
+                  input_file = optarg;
+                  break;
+
+              case 'o':
+                  output_file = optarg;
+                  break;
+
+              case 'f':
+                  filter_exp = optarg;
+                  break;
+
+              case 'h':
+                  has_header = true;
+                  break;
+
+              case 'd':
+                  delimiter = optarg[0];
+                  break;
+
+              case 's':
+                  keep_order = true;
+                  break;
+
+              case 'm':
+                  memory_mb = atoi(optarg);
+                  break;
+
+              case 't':
+                  num_threads = atoi(optarg);
+                  break;
+
+              default:
+                  ShowDistinctUsage();
+                  exit (0);
+          }
+      }
+
+      if (input_file.empty()) {
+          cerr << "Specify input file. \n";
+          exit(0);
+      } else if (output_file.empty()) {
+          cerr << "Specify output file \n";
+          exit(0);
+      }
+
+      csv::compute::CSVCompute::Distinct(input_file, output_file, filter_exp, has_header, delimiter,
+                                         std::max<size_t>(1, memory_mb) * 1024 * 1024, num_threads,
+                                         keep_order);
   } else {
-      cerr << "Specify either JOIN or COMPUTE\n";
+      cerr << "Specify either JOIN, COMPUTE, SORT, DISTINCT or SERVE\n";
       ShowUsage();
       ShowJoinUsage();
+      ShowSortUsage();
+      ShowDistinctUsage();
+      ShowServeUsage();
       exit(0);
   }
 
 ////////////////////////////////
+}
+
+int main(int argc, char **argv) {
+
+  // This tool has 5 main categories
+  // COMPUTE, JOIN, SORT, DISTINCT and SERVE
+  if (argc < 2) {
+      ShowUsage();
+      ShowJoinUsage();
+      ShowSortUsage();
+      ShowDistinctUsage();
+      ShowServeUsage();
+      exit(0);
+  }
+
+  if (!strcmp(argv[1], "SERVE")) {
+
+      string socket_path;
+
+      while (1) {
+          static struct option long_options[] =
+          {
+              {"socket", required_argument, 0, 'S'},
+              {0,0,0,0},
+          };
+          /* getopt_long stores the option index here. */
+          int option_index = 0;
+
+          int c = getopt_long (argc, argv, "S:",
+              long_options, &option_index);
+
+          /* Detect the end of the options. */
+          if (c == -1)
+              break;
+
+          switch (c) {
+              case 'S':
+                  socket_path = optarg;
+                  break;
+
+              default:
+                  ShowServeUsage();
+                  exit (0);
+          }
+      }
+
+      if (socket_path.empty()) {
+          cerr << "Specify the socket -S. \n";
+          exit(0);
+      }
+      csv::server::Serve(socket_path, RunCommand, PrepareWarm, csv::compute::JoinTable::CacheMutex());
+  }
+
+  // Any other command runs here, or in the server
+  // given by --server.
+  string server = csv::server::TakeServerOption(argc, argv);
+  if (!server.empty()) {
+      return csv::server::Forward(server, argc, argv);
+  } else {
+      RunCommand(argc, argv);
+  }
 
  return 0;
 }
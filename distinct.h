@@ -0,0 +1,235 @@
+#ifndef _CSV_DISTINCT_
+#define _CSV_DISTINCT_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <stdint.h>
+#include "util.h"
+
+using namespace std;
+namespace csv { namespace distinct {
+
+// Duplicate elimination works on entries, the 64 bit hash of a
+// row's key and where the row is in the input. Entries are
+// partitioned on the top bits of the hash, equal keys always
+// share a partition, so partitions are deduplicated on their
+// own, in parallel, with a table sized for one partition.
+// Rows are only looked at again when two hashes are equal.
+
+struct RowEntry {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t length;
+};
+
+// Key of a row, the unquoted cells of the whole row or of
+// some columns, so "a",b and a,b are the same row.
+struct RowKey {
+    // key_index - the key columns, empty for the whole row.
+    RowKey (const csv::util::Tokenizer& tokenizer, const vector<int>& key_index)
+        : tokenizer_(tokenizer), key_index_(key_index)
+    {}
+
+    // fields and scratch are space for the caller's thread.
+    uint64_t Hash (const char* row, size_t length,
+                   vector<csv::util::Slice>& fields, string& scratch) const {
+        if (key_index_.empty()) {
+            // A row without quotes is its own unquoted text,
+            // others hash their cells unquoted and joined the
+            // same way.
+            if (!memchr(row, tokenizer_.GetQuote(), length)) {
+                return csv::util::HashKey(row, length);
+            }
+            tokenizer_.Split(row, length, fields);
+            string text;
+            for (size_t i = 0; i < fields.size(); ++i) {
+                if (i > 0) {
+                    text.push_back(tokenizer_.GetDelimiter());
+                }
+                csv::util::Slice cell = Cell(fields, i, scratch);
+                text.append(cell.data, cell.size);
+            }
+            return csv::util::HashKey(text.data(), text.size());
+        }
+
+        tokenizer_.Split(row, length, fields);
+        uint64_t hash = 0;
+        for (auto &index : key_index_) {
+            csv::util::Slice cell = Cell(fields, index, scratch);
+            hash = csv::util::HashInt(static_cast<int64_t>(hash ^ csv::util::HashKey(cell.data, cell.size)));
+        }
+        return hash;
+    }
+
+    bool Equal (const char* a, size_t a_length, const char* b, size_t b_length,
+                vector<csv::util::Slice>& fields_a, vector<csv::util::Slice>& fields_b,
+                string& scratch_a, string& scratch_b) const {
+        char quote = tokenizer_.GetQuote();
+        bool whole_row = key_index_.empty();
+        if (whole_row && !memchr(a, quote, a_length) && !memchr(b, quote, b_length)) {
+            return a_length == b_length && memcmp(a, b, a_length) == 0;
+        }
+
+        tokenizer_.Split(a, a_length, fields_a);
+        tokenizer_.Split(b, b_length, fields_b);
+        if (whole_row && fields_a.size() != fields_b.size()) {
+            return false;
+        }
+        size_t num_cells = whole_row ? fields_a.size() : key_index_.size();
+        for (size_t i = 0; i < num_cells; ++i) {
+            int index = whole_row ? static_cast<int>(i) : key_index_[i];
+            csv::util::Slice cell_a = Cell(fields_a, index, scratch_a);
+            csv::util::Slice cell_b = Cell(fields_b, index, scratch_b);
+            if (cell_a.size != cell_b.size || memcmp(cell_a.data, cell_b.data, cell_a.size) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    // Cell text, unquoted into scratch when the cell is
+    // quoted. Missing cells are empty.
+    csv::util::Slice Cell (const vector<csv::util::Slice>& fields, int index, string& scratch) const {
+        if (static_cast<size_t>(index) >= fields.size()) {
+            csv::util::Slice empty = {"", 0};
+            return empty;
+        }
+
+        const csv::util::Slice& field = fields[index];
+        char quote = tokenizer_.GetQuote();
+        if (field.size == 0 || field.data[0] != quote) {
+            return field;
+        }
+        if (field.size >= 2 && field.data[field.size - 1] == quote &&
+            !memchr(field.data + 1, quote, field.size - 2)) {
+            // No escaped quotes, the text is in place.
+            csv::util::Slice cell = {field.data + 1, field.size - 2};
+            return cell;
+        }
+        scratch = tokenizer_.Unquote(field);
+        csv::util::Slice cell = {scratch.data(), scratch.size()};
+        return cell;
+    }
+
+    csv::util::Tokenizer tokenizer_;
+    vector<int> key_index_;
+};
+
+// Entries by partition, in input order within a partition.
+// Beyond half the memory budget every partition is appended
+// to its own file and cleared, the other half is left for
+// deduplicating partitions.
+struct PartitionedEntries {
+    static const size_t kNumPartitions = 256;
+
+    PartitionedEntries (size_t memory_budget, const string& spill_prefix)
+        : memory_budget_(memory_budget), spill_prefix_(spill_prefix),
+          num_entries_(0), spilled_(false), partitions_(kNumPartitions)
+    {}
+
+    ~PartitionedEntries () {
+        if (spilled_) {
+            for (size_t p = 0; p < kNumPartitions; ++p) {
+                remove(SpillFileName(p).c_str());
+            }
+        }
+    }
+
+    static size_t Partition (uint64_t hash) {
+        return hash >> 56;
+    }
+
+    // Entries of the next part of the input, by partition.
+    void Add (const vector<vector<RowEntry>>& partitions) {
+        for (size_t p = 0; p < kNumPartitions; ++p) {
+            partitions_[p].insert(partitions_[p].end(), partitions[p].begin(), partitions[p].end());
+            num_entries_ += partitions[p].size();
+        }
+        if (num_entries_ * sizeof(RowEntry) * 2 > memory_budget_) {
+            Spill();
+        }
+    }
+
+    // All entries of partition p, in input order. Spilled
+    // ones came first.
+    void Load (size_t p, vector<RowEntry>& entries) const {
+        entries.clear();
+        if (spilled_) {
+            ifstream spill_read(SpillFileName(p).c_str(), std::ifstream::binary);
+            spill_read.seekg(0, std::ios::end);
+            size_t size = spill_read.tellg();
+            spill_read.seekg(0);
+            entries.resize(size / sizeof(RowEntry));
+            spill_read.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(RowEntry));
+        }
+        entries.insert(entries.end(), partitions_[p].begin(), partitions_[p].end());
+    }
+
+private:
+    string SpillFileName (size_t p) const {
+        return spill_prefix_ + to_string(p);
+    }
+
+    void Spill () {
+        for (size_t p = 0; p < kNumPartitions; ++p) {
+            string spill_file = SpillFileName(p);
+            ofstream spill_write(spill_file.c_str(),
+                                 std::ofstream::binary | (spilled_ ? std::ofstream::app : std::ofstream::trunc));
+            spill_write.write(reinterpret_cast<const char*>(partitions_[p].data()),
+                              partitions_[p].size() * sizeof(RowEntry));
+            if (!spill_write) {
+                cerr << "Could not write distinct spill file " << spill_file << ".\n";
+                exit(0);
+            }
+            vector<RowEntry>().swap(partitions_[p]);
+        }
+        spilled_ = true;
+        num_entries_ = 0;
+    }
+
+    size_t memory_budget_;
+    string spill_prefix_;
+    size_t num_entries_;
+    bool spilled_;
+    vector<vector<RowEntry>> partitions_;
+};
+
+// Drop every entry whose key came earlier in entries, so the
+// first row of each key is kept, order unchanged. Open
+// addressing on the low bits of the hash (the high bits chose
+// the partition), equal(a, b) confirms a matching hash.
+template <typename Equal>
+void Dedupe (vector<RowEntry>& entries, Equal equal) {
+    size_t capacity = 16;
+    while (capacity < entries.size() * 2) {
+        capacity <<= 1;
+    }
+
+    // Index + 1 of the kept entry, 0 is empty.
+    vector<uint32_t> slots(capacity, 0);
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        RowEntry entry = entries[i];
+        size_t slot = entry.hash & (capacity - 1);
+        bool duplicate = false;
+        while (slots[slot] != 0 && !duplicate) {
+            const RowEntry& other = entries[slots[slot] - 1];
+            duplicate = (other.hash == entry.hash && equal(other, entry));
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        if (!duplicate) {
+            // Kept entries are compacted to the front, slots
+            // only point below kept.
+            entries[kept] = entry;
+            slots[slot] = ++kept;
+        }
+    }
+    entries.resize(kept);
+}
+
+} } //namespace
+#endif
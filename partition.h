@@ -0,0 +1,313 @@
+#ifndef _CSV_PARTITION_
+#define _CSV_PARTITION_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include "util.h"
+
+using namespace std;
+namespace csv { namespace util {
+
+// Output split on one column into num_partitions files, a row
+// goes to partition HashKey(cell) % num_partitions, so all
+// rows sharing a key land in the same file.
+struct PartitionSpec {
+    PartitionSpec () : num_partitions(0)
+    {}
+
+    bool Enabled () const {
+        return num_partitions > 0;
+    }
+
+    string col_name;
+    size_t num_partitions;
+};
+
+// out.csv -> out_part3.csv
+string PartitionFileName (const string& file_name, size_t partition) {
+    size_t dot = file_name.find_last_of('.');
+    size_t slash = file_name.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        dot = file_name.size();
+    }
+    return file_name.substr(0, dot) + "_part" + to_string(partition) + file_name.substr(dot);
+}
+
+// Stream buffer writing partitioned output. Whatever is
+// written to it is cut into records as it arrives, the first
+// one is the header and goes to every partition, the others
+// to the partition of their key cell. Records are gathered in
+// a buffer per partition, full buffers are queued to a writer
+// thread, so the producer never waits on the files unless
+// the writer falls kMaxQueued buffers behind.
+class PartitionedStreamBuf : public std::streambuf {
+public:
+    static const size_t kMaxQueued = 16;
+
+    PartitionedStreamBuf (const string& output_file_name, const PartitionSpec& spec)
+        : col_name_(spec.col_name), col_index_(-1), quoted_(0),
+          closed_(false), done_(false), failed_(false)
+    {
+        // Buffers of all partitions together stay around
+        // 64MB, but never get too small to write.
+        buffer_size_ = std::max<size_t>(16 << 10, std::min<size_t>(1 << 20, (64 << 20) / spec.num_partitions));
+        for (size_t p = 0; p < spec.num_partitions; ++p) {
+            string file_name = PartitionFileName(output_file_name, p);
+            int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                cerr << "Could not open " << file_name << ".\n";
+                exit(0);
+            }
+            fds_.push_back(fd);
+            file_names_.push_back(file_name);
+            buffers_.push_back(string());
+            buffers_.back().reserve(buffer_size_);
+        }
+        writer_ = thread(&PartitionedStreamBuf::WriteQueued, this);
+    }
+
+    ~PartitionedStreamBuf () {
+        Close();
+    }
+
+    // Write out what is buffered and close the files.
+    void Close () {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+
+        if (!pending_.empty()) {
+            // Last record without its newline.
+            pending_.push_back('\n');
+            Dispatch(pending_.data(), pending_.size());
+            pending_.clear();
+        }
+        for (size_t p = 0; p < buffers_.size(); ++p) {
+            Submit(p);
+        }
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            done_ = true;
+        }
+        not_empty_.notify_one();
+        writer_.join();
+
+        for (auto &fd : fds_) {
+            close(fd);
+        }
+        if (failed_) {
+            cerr << "Could not write partition " << failed_file_ << ".\n";
+            exit(0);
+        }
+    }
+
+protected:
+    std::streamsize xsputn (const char* data, std::streamsize len) {
+        Consume(data, len);
+        return len;
+    }
+
+    int_type overflow (int_type c) {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch = traits_type::to_char_type(c);
+            Consume(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    struct Chunk {
+        size_t partition;
+        string data;
+    };
+
+    void Consume (const char* data, size_t len) {
+        while (len > 0) {
+            size_t end = tokenizer_.ScanRecordEnd(data, len, quoted_);
+            if (end == string::npos) {
+                pending_.append(data, len);
+                return;
+            }
+
+            if (pending_.empty()) {
+                Dispatch(data, end);
+            } else {
+                pending_.append(data, end);
+                Dispatch(pending_.data(), pending_.size());
+                pending_.clear();
+            }
+            data += end;
+            len -= end;
+        }
+    }
+
+    // record ends with its newline
+    void Dispatch (const char* record, size_t len) {
+        if (col_index_ < 0) {
+            ResolveColumn(record, len - 1);
+            for (size_t p = 0; p < buffers_.size(); ++p) {
+                Append(p, record, len);
+            }
+            return;
+        }
+
+        Slice field = tokenizer_.Field(record, len - 1, col_index_);
+        uint64_t hash;
+        if (field.size > 0 && field.data[0] == tokenizer_.GetQuote()) {
+            string text = tokenizer_.Unquote(field);
+            hash = HashKey(text.data(), text.size());
+        } else {
+            hash = HashKey(field.data, field.size);
+        }
+        Append(hash % buffers_.size(), record, len);
+    }
+
+    void ResolveColumn (const char* header, size_t len) {
+        vector<Slice> fields;
+        tokenizer_.Split(header, len, fields);
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (tokenizer_.Unquote(fields[i]) == col_name_) {
+                col_index_ = i;
+                return;
+            }
+        }
+        cerr << "Could not find partition column " << col_name_ << " in the output.\n";
+        exit(0);
+    }
+
+    void Append (size_t partition, const char* data, size_t len) {
+        buffers_[partition].append(data, len);
+        if (buffers_[partition].size() >= buffer_size_) {
+            Submit(partition);
+        }
+    }
+
+    // Queue the partition's buffer to the writer, and take
+    // a drained one back in its place.
+    void Submit (size_t partition) {
+        if (buffers_[partition].empty()) {
+            return;
+        }
+
+        Chunk chunk;
+        chunk.partition = partition;
+        chunk.data.swap(buffers_[partition]);
+        {
+            unique_lock<mutex> lock(mutex_);
+            not_full_.wait(lock, [this] { return queue_.size() < kMaxQueued; });
+            queue_.push_back(std::move(chunk));
+            if (!free_.empty()) {
+                buffers_[partition].swap(free_.back());
+                free_.pop_back();
+            }
+        }
+        not_empty_.notify_one();
+    }
+
+    void WriteQueued () {
+        while (true) {
+            Chunk chunk;
+            {
+                unique_lock<mutex> lock(mutex_);
+                not_empty_.wait(lock, [this] { return !queue_.empty() || done_; });
+                if (queue_.empty()) {
+                    return;
+                }
+                chunk = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            not_full_.notify_one();
+
+            const char* p = chunk.data.data();
+            size_t left = chunk.data.size();
+            while (left > 0 && !failed_) {
+                ssize_t written = write(fds_[chunk.partition], p, left);
+                if (written < 0) {
+                    failed_ = true;
+                    failed_file_ = file_names_[chunk.partition];
+                    break;
+                }
+                p += written;
+                left -= written;
+            }
+
+            chunk.data.clear();
+            lock_guard<mutex> lock(mutex_);
+            free_.push_back(std::move(chunk.data));
+        }
+    }
+
+    // Producer side
+    Tokenizer tokenizer_;
+    string col_name_;
+    int col_index_;
+    uint64_t quoted_;
+    string pending_;
+    vector<string> buffers_;
+    size_t buffer_size_;
+    bool closed_;
+
+    // Shared with the writer
+    mutex mutex_;
+    condition_variable not_empty_;
+    condition_variable not_full_;
+    deque<Chunk> queue_;
+    vector<string> free_;
+    bool done_;
+
+    // Writer side, read after the join
+    vector<int> fds_;
+    vector<string> file_names_;
+    bool failed_;
+    string failed_file_;
+    thread writer_;
+};
+
+// Output of a command, a plain file or, when partition is
+// enabled, the partition files.
+class ResultOutput {
+public:
+    ResultOutput (const string& file_name, const PartitionSpec& partition,
+                  std::ios_base::openmode mode = std::ios_base::out)
+        : stream_(nullptr)
+    {
+        if (partition.Enabled()) {
+            partitioned_.reset(new PartitionedStreamBuf(file_name, partition));
+            stream_.rdbuf(partitioned_.get());
+        } else {
+            file_.open(file_name.c_str(), mode);
+            stream_.rdbuf(file_.rdbuf());
+        }
+    }
+
+    ostream& Stream () {
+        return stream_;
+    }
+
+    void Close () {
+        if (partitioned_) {
+            partitioned_->Close();
+        } else {
+            file_.close();
+        }
+    }
+
+private:
+    ofstream file_;
+    unique_ptr<PartitionedStreamBuf> partitioned_;
+    ostream stream_;
+};
+
+} } //namespace
+#endif
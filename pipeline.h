@@ -0,0 +1,495 @@
+#ifndef _CSV_PIPELINE_
+#define _CSV_PIPELINE_
+
+#include <coroutine>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <cstdlib>
+#include <stdint.h>
+#include "tokenizer.h"
+
+using namespace std;
+namespace csv { namespace pipeline {
+
+// Staged dataflow for the commands. A command is a few stages,
+// coroutines passing batches of records through bounded
+// channels, run by a pool of threads:
+//   ReadStage -> MapStage x num_threads -> WriteStage
+// A stage waiting on a full or empty channel is suspended and
+// its thread runs another stage, so reading, evaluating and
+// writing overlap and the map stages use every core. Batches
+// carry a sequence number, the writer restores input order.
+
+// Bounded lock free multi producer multi consumer queue
+// (Vyukov). Every cell has a sequence number telling whether
+// it is free for the producer of the current lap or holds a
+// value for its consumer, producers and consumers only
+// contend on their own position counter.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue (size_t capacity)
+        : enqueue_pos_(0), dequeue_pos_(0)
+    {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Moves from value, false if the queue is full.
+    bool TryPush (T& value) {
+        Cell* cell;
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // False if the queue is empty.
+    bool TryPop (T& value) {
+        Cell* cell;
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) atomic<size_t> enqueue_pos_;
+    alignas(64) atomic<size_t> dequeue_pos_;
+};
+
+class Executor;
+
+// A stage. Created suspended, Executor::Spawn starts it and
+// its frame is freed when it returns.
+struct Task {
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct FinalAwaiter {
+        bool await_ready () noexcept { return false; }
+        void await_suspend (Handle handle) noexcept;
+        void await_resume () noexcept {}
+    };
+
+    struct promise_type {
+        Task get_return_object () { return Task(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend () noexcept { return {}; }
+        FinalAwaiter final_suspend () noexcept { return {}; }
+        void return_void () {}
+        void unhandled_exception () { std::terminate(); }
+
+        Executor* executor = nullptr;
+    };
+
+    explicit Task (Handle h) : handle(h)
+    {}
+
+    Handle handle;
+};
+
+// Thread pool resuming ready stages. Run returns once every
+// spawned stage is done.
+class Executor {
+public:
+    explicit Executor (size_t num_threads)
+        : num_threads_(std::max<size_t>(1, num_threads)), pending_(0)
+    {}
+
+    void Spawn (Task task) {
+        task.handle.promise().executor = this;
+        {
+            lock_guard<mutex> lock(mutex_);
+            pending_++;
+        }
+        Schedule(task.handle);
+    }
+
+    void Schedule (std::coroutine_handle<> handle) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            ready_.push_back(handle);
+        }
+        ready_cv_.notify_one();
+    }
+
+    void Run () {
+        csv::util::RunParallel(num_threads_, [this](size_t) { Work(); });
+    }
+
+    void TaskDone () {
+        lock_guard<mutex> lock(mutex_);
+        if (--pending_ == 0) {
+            ready_cv_.notify_all();
+        }
+    }
+
+private:
+    void Work () {
+        while (true) {
+            std::coroutine_handle<> handle;
+            {
+                unique_lock<mutex> lock(mutex_);
+                ready_cv_.wait(lock, [this] { return !ready_.empty() || pending_ == 0; });
+                if (ready_.empty()) {
+                    return;
+                }
+                handle = ready_.front();
+                ready_.pop_front();
+            }
+            handle.resume();
+        }
+    }
+
+    size_t num_threads_;
+    mutex mutex_;
+    condition_variable ready_cv_;
+    deque<std::coroutine_handle<>> ready_;
+    size_t pending_;
+};
+
+inline void Task::FinalAwaiter::await_suspend (Handle handle) noexcept {
+    Executor* executor = handle.promise().executor;
+    handle.destroy();
+    executor->TaskDone();
+}
+
+// Bounded channel between stages.
+//   co_await channel.Push(std::move(item));
+//   while (co_await channel.Pop(item)) { ... }
+// Items go through the lock free queue. A stage finding it
+// full (empty) parks itself with the item (the place for it),
+// the stage making room (an item) hands it over and schedules
+// the parked one. The mutex is only taken to park and hand
+// over, the waiting counts let the other side skip it.
+// Pop returns false once every producer closed the channel
+// and it is drained.
+template <typename T>
+class Channel {
+public:
+    Channel (Executor& executor, size_t capacity, size_t num_producers = 1)
+        : executor_(executor), queue_(capacity), push_waiting_(0), pop_waiting_(0),
+          producers_(num_producers), closed_(false)
+    {}
+
+    struct PushAwaiter {
+        bool await_ready () {
+            if (!channel.queue_.TryPush(value)) {
+                return false;
+            }
+            channel.AfterPush();
+            return true;
+        }
+
+        bool await_suspend (std::coroutine_handle<> handle) {
+            lock_guard<mutex> lock(channel.mutex_);
+            channel.push_waiting_.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (channel.queue_.TryPush(value)) {
+                channel.push_waiting_.fetch_sub(1);
+                channel.ServeLocked();
+                return false;
+            }
+            Waiter waiter = {handle, &value, nullptr};
+            channel.push_waiters_.push_back(waiter);
+            return true;
+        }
+
+        void await_resume () {}
+
+        Channel& channel;
+        T value;
+    };
+
+    struct PopAwaiter {
+        bool await_ready () {
+            if (!channel.queue_.TryPop(value)) {
+                return false;
+            }
+            result = true;
+            channel.AfterPop();
+            return true;
+        }
+
+        bool await_suspend (std::coroutine_handle<> handle) {
+            lock_guard<mutex> lock(channel.mutex_);
+            channel.pop_waiting_.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (channel.queue_.TryPop(value)) {
+                result = true;
+            } else if (!channel.closed_) {
+                Waiter waiter = {handle, &value, &result};
+                channel.pop_waiters_.push_back(waiter);
+                return true;
+            }
+            channel.pop_waiting_.fetch_sub(1);
+            channel.ServeLocked();
+            return false;
+        }
+
+        bool await_resume () {
+            return result;
+        }
+
+        Channel& channel;
+        T& value;
+        bool result;
+    };
+
+    PushAwaiter Push (T value) {
+        return PushAwaiter{*this, std::move(value)};
+    }
+
+    PopAwaiter Pop (T& value) {
+        return PopAwaiter{*this, value, false};
+    }
+
+    // Push without waiting, for filling a channel before the
+    // stages run. False if it is full.
+    bool TryPush (T value) {
+        if (!queue_.TryPush(value)) {
+            return false;
+        }
+        AfterPush();
+        return true;
+    }
+
+    // A producer is done, the last one ends the channel.
+    void Close () {
+        lock_guard<mutex> lock(mutex_);
+        if (--producers_ > 0) {
+            return;
+        }
+        closed_ = true;
+        ServeLocked();
+        for (auto &waiter : pop_waiters_) {
+            *waiter.result = false;
+            pop_waiting_.fetch_sub(1);
+            executor_.Schedule(waiter.handle);
+        }
+        pop_waiters_.clear();
+    }
+
+private:
+    struct Waiter {
+        std::coroutine_handle<> handle;
+        T* value;
+        bool* result;
+    };
+
+    void AfterPush () {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (pop_waiting_.load() > 0) {
+            lock_guard<mutex> lock(mutex_);
+            ServeLocked();
+        }
+    }
+
+    void AfterPop () {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (push_waiting_.load() > 0) {
+            lock_guard<mutex> lock(mutex_);
+            ServeLocked();
+        }
+    }
+
+    // Hand items to parked consumers and room to parked
+    // producers while the queue allows.
+    void ServeLocked () {
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            while (!pop_waiters_.empty() && queue_.TryPop(*pop_waiters_.front().value)) {
+                *pop_waiters_.front().result = true;
+                pop_waiting_.fetch_sub(1);
+                executor_.Schedule(pop_waiters_.front().handle);
+                pop_waiters_.pop_front();
+                progress = true;
+            }
+            while (!push_waiters_.empty() && queue_.TryPush(*push_waiters_.front().value)) {
+                push_waiting_.fetch_sub(1);
+                executor_.Schedule(push_waiters_.front().handle);
+                push_waiters_.pop_front();
+                progress = true;
+            }
+        }
+    }
+
+    Executor& executor_;
+    BoundedQueue<T> queue_;
+    atomic<size_t> push_waiting_;
+    atomic<size_t> pop_waiting_;
+    mutex mutex_;
+    deque<Waiter> push_waiters_;
+    deque<Waiter> pop_waiters_;
+    size_t producers_;
+    bool closed_;
+};
+
+// A batch of records as read, numbered in input order.
+struct RecordBatch {
+    size_t sequence;
+    vector<string> records;
+};
+
+// Output text of a batch, rows newline terminated. header is
+// the output header, written before the first chunk with rows
+// unless the command wrote it already, an empty result gets
+// no header.
+struct OutputChunk {
+    size_t sequence;
+    string text;
+    string header;
+};
+
+// Evaluates batches, from several threads at once.
+struct BatchEvaluator {
+    virtual ~BatchEvaluator ()
+    {}
+
+    virtual void Evaluate (const RecordBatch& batch, OutputChunk& chunk) const = 0;
+};
+
+// Cuts the input into batches of records. Takes a credit per
+// batch, which the writer gives back once the batch is
+// written, so only so many batches are ever in flight.
+Task ReadStage (istream& input, const csv::util::Tokenizer& tokenizer, size_t batch_size,
+                Channel<size_t>& credits, Channel<RecordBatch>& batches) {
+    size_t credit;
+    for (size_t sequence = 0; co_await credits.Pop(credit); ++sequence) {
+        RecordBatch batch;
+        batch.sequence = sequence;
+        string record;
+        while (batch.records.size() < batch_size && tokenizer.ReadRecord(input, record)) {
+            batch.records.push_back(std::move(record));
+        }
+        if (batch.records.empty()) {
+            break;
+        }
+
+        bool last = batch.records.size() < batch_size;
+        co_await batches.Push(std::move(batch));
+        if (last) {
+            break;
+        }
+    }
+    batches.Close();
+}
+
+// Tokenizes and evaluates (or joins) batches with fn(batch,
+// chunk). Several run side by side on one pair of channels.
+template <typename Fn>
+Task MapStage (Channel<RecordBatch>& batches, Channel<OutputChunk>& chunks, const Fn& fn) {
+    RecordBatch batch;
+    while (co_await batches.Pop(batch)) {
+        OutputChunk chunk;
+        chunk.sequence = batch.sequence;
+        fn(batch, chunk);
+        co_await chunks.Push(std::move(chunk));
+    }
+    chunks.Close();
+}
+
+// Writes chunks in sequence order, holding back the ones
+// that overtook an earlier chunk.
+Task WriteStage (Channel<OutputChunk>& chunks, Channel<size_t>& credits,
+                 ostream& output, bool& header_written) {
+    map<size_t, OutputChunk> pending;
+    size_t next = 0;
+    OutputChunk chunk;
+    while (co_await chunks.Pop(chunk)) {
+        size_t sequence = chunk.sequence;
+        pending[sequence] = std::move(chunk);
+        for (auto it = pending.find(next); it != pending.end(); it = pending.find(next)) {
+            if (!header_written && !it->second.text.empty()) {
+                output << it->second.header << endl;
+                header_written = true;
+            }
+            output.write(it->second.text.data(), it->second.text.size());
+            pending.erase(it);
+            credits.TryPush(next++);
+        }
+    }
+}
+
+// Read the records of input, map every batch through
+// fn(batch, chunk) on num_threads threads (0 - one per core),
+// write the chunks to output in input order.
+template <typename Fn>
+void RunStages (istream& input, const csv::util::Tokenizer& tokenizer, const Fn& fn,
+                ostream& output, bool& header_written, size_t num_threads = 0) {
+    if (num_threads == 0) {
+        num_threads = std::max<unsigned>(1, thread::hardware_concurrency());
+    }
+
+    const size_t kBatchSize = 4096;
+    size_t in_flight = 4 * num_threads;
+    Executor executor(num_threads);
+    Channel<size_t> credits(executor, in_flight);
+    Channel<RecordBatch> batches(executor, 2 * num_threads);
+    Channel<OutputChunk> chunks(executor, 2 * num_threads, num_threads);
+    for (size_t i = 0; i < in_flight; ++i) {
+        credits.TryPush(i);
+    }
+
+    executor.Spawn(ReadStage(input, tokenizer, kBatchSize, credits, batches));
+    for (size_t i = 0; i < num_threads; ++i) {
+        executor.Spawn(MapStage(batches, chunks, fn));
+    }
+    executor.Spawn(WriteStage(chunks, credits, output, header_written));
+    executor.Run();
+}
+
+} } //namespace
+#endif
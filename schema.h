@@ -0,0 +1,387 @@
+#ifndef _CSV_SCHEMA_
+#define _CSV_SCHEMA_
+
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include "util.h"
+#include "pipeline.h"
+
+using namespace std;
+namespace csv { namespace schema {
+
+// Compile time record layouts for files whose columns are
+// known up front. A CSVRecord keeps a pair<T,bool> per cell
+// and resolves everything at run time, a Schema keeps one
+// flat vector per column and generates the parser and the
+// expression evaluation for the layout, so the whole
+// COMPUTE loop is inlined. Files not matching any of the
+// KnownSchemas go through the dynamic CSVRecord path.
+
+// Declare a column of a schema
+//   CSV_COLUMN(AAA, int);
+#define CSV_COLUMN(col_name, col_type) \
+    struct col_name { \
+        typedef col_type type; \
+        static const char* name() { return #col_name; } \
+    }
+
+// Cell parsers over [p, end), the cell with its quotes
+// stripped. Integers are read like atoi: leading blanks,
+// sign, digits.
+template <typename T>
+typename enable_if<is_integral<T>::value, T>::type
+ParseCell (const char* p, const char* end) {
+    while (p != end && isspace(static_cast<unsigned char>(*p))) {
+        ++p;
+    }
+
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        ++p;
+    }
+
+    typename make_unsigned<T>::type value = 0;
+    while (p != end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        ++p;
+    }
+    return static_cast<T>(negative ? 0 - value : value);
+}
+
+template <typename T>
+typename enable_if<is_floating_point<T>::value, T>::type
+ParseCell (const char* p, const char* end) {
+    // strtod wants a terminated string.
+    char buf[64];
+    size_t len = std::min<size_t>(end - p, sizeof(buf) - 1);
+    memcpy(buf, p, len);
+    buf[len] = 0;
+    return static_cast<T>(strtod(buf, nullptr));
+}
+
+// Cell writers, same text as operator<< would produce.
+template <typename T>
+typename enable_if<is_integral<T>::value>::type
+WriteCell (T value, string& out) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    typename make_unsigned<T>::type v = value;
+    bool negative = value < 0;
+    if (negative) {
+        v = 0 - v;
+    }
+    do {
+        *--p = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    if (negative) {
+        *--p = '-';
+    }
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+template <typename T>
+typename enable_if<is_floating_point<T>::value>::type
+WriteCell (T value, string& out) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%g", static_cast<double>(value));
+    out.append(buf, len);
+}
+
+// Expression operators
+struct Add {
+    template <typename X, typename Y>
+    auto operator()(X x, Y y) const -> decltype(x + y) { return x + y; }
+};
+
+struct Subtract {
+    template <typename X, typename Y>
+    auto operator()(X x, Y y) const -> decltype(x - y) { return x - y; }
+};
+
+struct Multiply {
+    template <typename X, typename Y>
+    auto operator()(X x, Y y) const -> decltype(x * y) { return x * y; }
+};
+
+struct Divide {
+    template <typename X, typename Y>
+    auto operator()(X x, Y y) const -> decltype(x / y) { return x / y; }
+};
+
+// A fixed layout, Cols are CSV_COLUMN types in file order.
+template <typename... Cols>
+struct Schema {
+    static const size_t kNumCols = sizeof...(Cols);
+
+    // Struct of arrays holding a batch of records,
+    // one vector per column.
+    struct Batch {
+        Batch () : size(0)
+        {}
+
+        void Clear () {
+            ClearColumns(index_sequence_for<Cols...>());
+            size = 0;
+        }
+
+        tuple<vector<typename Cols::type>...> columns;
+        size_t size;
+
+    private:
+        template <size_t... I>
+        void ClearColumns (index_sequence<I...>) {
+            int expand[] = {0, (get<I>(columns).clear(), 0)...};
+            (void)expand;
+        }
+    };
+
+    static const char* GetColumnName (size_t col_index) {
+        static const char* names[] = {Cols::name()...};
+        return names[col_index];
+    }
+
+    static int GetColumnIndex (const string& col_name) {
+        for (size_t i = 0; i < kNumCols; ++i) {
+            if (col_name == GetColumnName(i)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // The file header has exactly this layout.
+    static bool Matches (csv::util::Header& header) {
+        if (header.GetNumCols() != static_cast<int>(kNumCols)) {
+            return false;
+        }
+
+        for (size_t i = 0; i < kNumCols; ++i) {
+            if (header.GetColumnName(i) != GetColumnName(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Append the record to the batch. Missing cells are 0.
+    // fields is scratch space for the tokenizer.
+    static void ParseRecord (const string& line, Batch& batch,
+                             const csv::util::Tokenizer& tokenizer,
+                             vector<csv::util::Slice>& fields) {
+        tokenizer.Split(line.data(), line.size(), fields);
+        ParseCells(fields, tokenizer.GetQuote(), batch, index_sequence_for<Cols...>());
+        batch.size++;
+    }
+
+private:
+    template <typename T>
+    static T ParseField (const vector<csv::util::Slice>& fields, char quote, size_t col_index) {
+        if (col_index >= fields.size()) {
+            return T();
+        }
+
+        const char* p = fields[col_index].data;
+        const char* end = p + fields[col_index].size;
+        // Numbers hold no quotes, dropping the
+        // outer ones is enough.
+        if (p != end && *p == quote) {
+            ++p;
+            end = std::find(p, end, quote);
+        }
+        return ParseCell<T>(p, end);
+    }
+
+    template <size_t... I>
+    static void ParseCells (const vector<csv::util::Slice>& fields, char quote,
+                            Batch& batch, index_sequence<I...>) {
+        int expand[] = {0, (get<I>(batch.columns).push_back(
+                               ParseField<typename Cols::type>(fields, quote, I)), 0)...};
+        (void)expand;
+    }
+};
+
+// COMPUTE over a Schema. The expression is resolved once to
+// a function instantiated for its two columns and operator,
+// which evaluates a whole batch column-wise then writes it.
+template <typename S>
+struct StaticEvaluator : public csv::pipeline::BatchEvaluator {
+    typedef typename S::Batch Batch;
+    typedef void (*WriteFn)(const Batch&, const vector<bool>&, string&);
+
+    // Null when the file does not have this layout or the
+    // expression does not resolve against it.
+    static shared_ptr<csv::pipeline::BatchEvaluator> Make (csv::util::Header& header,
+                                                          const string& compute_expression,
+                                                          csv::util::SimpleStringFilter& filter,
+                                                          char delimiter = ',') {
+        if (!S::Matches(header)) {
+            return nullptr;
+        }
+
+        char oper = 0;
+        vector<string> operands;
+        if (!csv::util::SplitExpression(compute_expression, oper, operands) ||
+            operands.size() < 2) {
+            return nullptr;
+        }
+
+        int index_a = S::GetColumnIndex(operands[0]);
+        int index_b = S::GetColumnIndex(operands[1]);
+        if (index_a < 0 || index_b < 0) {
+            return nullptr;
+        }
+
+        shared_ptr<StaticEvaluator> evaluator = make_shared<StaticEvaluator>(delimiter);
+        evaluator->write_ = Resolve(oper, index_a, index_b);
+
+        // Columns allowed through the filter, the last one
+        // is the result.
+        evaluator->allow_.resize(S::kNumCols + 1);
+        csv::util::Header result_header;
+        for (size_t i = 0; i < S::kNumCols; ++i) {
+            result_header.AddColumn(S::GetColumnName(i));
+        }
+        result_header.AddColumn("result");
+        for (size_t i = 0; i <= S::kNumCols; ++i) {
+            evaluator->allow_[i] = filter.Allow(result_header.GetColumnName(i));
+        }
+        result_header.ApplyFilter(filter);
+        evaluator->header_ = result_header.GetHeaderString();
+        return evaluator;
+    }
+
+    explicit StaticEvaluator (char delimiter)
+        : tokenizer_(delimiter)
+    {}
+
+    void Evaluate (const csv::pipeline::RecordBatch& records,
+                   csv::pipeline::OutputChunk& chunk) const {
+        Batch batch;
+        vector<csv::util::Slice> fields;
+        for (auto &record : records.records) {
+            S::ParseRecord(record, batch, tokenizer_, fields);
+        }
+        write_(batch, allow_, chunk.text);
+        chunk.header = header_;
+    }
+
+private:
+    template <size_t A, size_t B, typename Op>
+    static void EvalAndWrite (const Batch& batch, const vector<bool>& allow, string& output) {
+        const auto& col_a = get<A>(batch.columns);
+        const auto& col_b = get<B>(batch.columns);
+        typedef decltype(Op()(col_a[0], col_b[0])) Result;
+
+        // Evaluate the batch first, a plain loop over two
+        // arrays the compiler can vectorize.
+        vector<Result> result(batch.size);
+        Op op;
+        for (size_t i = 0; i < batch.size; ++i) {
+            result[i] = op(col_a[i], col_b[i]);
+        }
+
+        for (size_t i = 0; i < batch.size; ++i) {
+            size_t row_start = output.size();
+            WriteCells(batch, i, allow, output, make_index_sequence<S::kNumCols>());
+            if (allow[S::kNumCols]) {
+                WriteCell(result[i], output);
+            } else if (output.size() > row_start) {
+                output.pop_back(); // trailing ,
+            }
+            output.push_back('\n');
+        }
+    }
+
+    template <size_t... I>
+    static void WriteCells (const Batch& batch, size_t row, const vector<bool>& allow,
+                            string& output, index_sequence<I...>) {
+        int expand[] = {0, (allow[I] ? (WriteCell(get<I>(batch.columns)[row], output),
+                                        output.push_back(','), 0) : 0)...};
+        (void)expand;
+    }
+
+    template <typename Op, size_t A>
+    struct Row {
+        static WriteFn Get (size_t index_b) {
+            return Pick(index_b, make_index_sequence<S::kNumCols>());
+        }
+
+        template <size_t... B>
+        static WriteFn Pick (size_t index_b, index_sequence<B...>) {
+            static const WriteFn fns[] = {&EvalAndWrite<A, B, Op>...};
+            return fns[index_b];
+        }
+    };
+
+    template <typename Op, size_t... A>
+    static WriteFn Pick (size_t index_a, size_t index_b, index_sequence<A...>) {
+        typedef WriteFn (*RowFn)(size_t);
+        static const RowFn rows[] = {&Row<Op, A>::Get...};
+        return rows[index_a](index_b);
+    }
+
+    static WriteFn Resolve (char oper, size_t index_a, size_t index_b) {
+        make_index_sequence<S::kNumCols> cols;
+        switch (oper) {
+            case '+':
+                return Pick<Add>(index_a, index_b, cols);
+            case '-':
+                return Pick<Subtract>(index_a, index_b, cols);
+            case '*':
+                return Pick<Multiply>(index_a, index_b, cols);
+            default:
+                return Pick<Divide>(index_a, index_b, cols);
+        }
+    }
+
+    csv::util::Tokenizer tokenizer_;
+    WriteFn write_;
+    vector<bool> allow_;
+    string header_;
+};
+
+// Try each schema in turn.
+template <typename... Schemas>
+struct SchemaList;
+
+template <>
+struct SchemaList<> {
+    static shared_ptr<csv::pipeline::BatchEvaluator> Make (csv::util::Header&, const string&,
+                                                          csv::util::SimpleStringFilter&, char) {
+        return nullptr;
+    }
+};
+
+template <typename S, typename... Rest>
+struct SchemaList<S, Rest...> {
+    static shared_ptr<csv::pipeline::BatchEvaluator> Make (csv::util::Header& header,
+                                                          const string& compute_expression,
+                                                          csv::util::SimpleStringFilter& filter,
+                                                          char delimiter) {
+        shared_ptr<csv::pipeline::BatchEvaluator> evaluator =
+            StaticEvaluator<S>::Make(header, compute_expression, filter, delimiter);
+        return evaluator ? evaluator :
+               SchemaList<Rest...>::Make(header, compute_expression, filter, delimiter);
+    }
+};
+
+// Layouts compiled in. Add production schemas here.
+namespace columns {
+    CSV_COLUMN(AAA, int);
+    CSV_COLUMN(BBB, int);
+    CSV_COLUMN(CCC, int);
+}
+
+typedef Schema<columns::AAA, columns::BBB, columns::CCC> LocalSchema;
+
+typedef SchemaList<LocalSchema> KnownSchemas;
+
+} } //namespace
+#endif
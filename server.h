@@ -0,0 +1,502 @@
+#ifndef _CSV_SERVER_
+#define _CSV_SERVER_
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+namespace csv { namespace server {
+
+// csv SERVE, a long running process on a Unix socket which
+// runs the command lines clients send it (--server <path>).
+// Every request is forked off the server, so it starts with
+// the JoinTable cache of the server in memory, and an error
+// exit ends only that request. Tables a request needs are
+// parsed into the cache in the background for the next
+// ones. A request runs in the client's working directory,
+// its stdout and stderr are relayed to the client as they
+// come, and the client exits with the request's status.
+// Output files are written by the request itself.
+//
+// A request is the client's working directory followed by its
+// arguments after argv[0], each NUL terminated, ended by the
+// client shutting down its side of the connection. The answer
+// is frames, a kind byte, a 4 byte length in host order and
+// that many bytes, the last one the exit status.
+
+const char kStdoutFrame = 'o';
+const char kStderrFrame = 'e';
+const char kExitFrame = 'x';
+
+// Runs one command line, argv[1] is the command.
+typedef void (*CommandFn)(int argc, char **argv);
+
+// Background work for a request, e.g. loading the tables it
+// uses into a cache.
+typedef function<void()> WarmJob;
+
+// Makes the warm job of a command line, on the server's main
+// thread. Relative paths in argv are relative to cwd, the job
+// must not depend on the working directory. Empty if there
+// is nothing to warm.
+typedef WarmJob (*PrepareFn)(const string& cwd, int argc, char **argv);
+
+// Remove --server <path> (also -S <path>, --server=<path>)
+// from the arguments. Returns the path, empty if not given.
+string TakeServerOption(int& argc, char **argv) {
+    string path;
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if ((arg == "--server" || arg == "-S") && i + 1 < argc) {
+            path = argv[++i];
+        } else if (arg.compare(0, 9, "--server=") == 0) {
+            path = arg.substr(9);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    argv[argc] = nullptr;
+    return path;
+}
+
+// path as seen from the directory cwd.
+string AbsolutePath(const string& cwd, const string& path) {
+    if (path.empty() || path[0] == '/') {
+        return path;
+    }
+    return cwd + "/" + path;
+}
+
+bool MakeAddress(const string& socket_path, sockaddr_un& addr) {
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    return true;
+}
+
+bool WriteAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+// False at end of file before len bytes.
+bool ReadAll(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t got = read(fd, data, len);
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        len -= got;
+    }
+    return true;
+}
+
+bool SendFrame(int fd, char kind, const char* data, uint32_t len) {
+    char head[1 + sizeof(len)];
+    head[0] = kind;
+    memcpy(head + 1, &len, sizeof(len));
+    return WriteAll(fd, head, sizeof(head)) && WriteAll(fd, data, len);
+}
+
+bool SendStatus(int fd, int32_t status) {
+    return SendFrame(fd, kExitFrame, reinterpret_cast<const char*>(&status), sizeof(status));
+}
+
+// Answer of a request which could not run.
+void SendError(int fd, const string& message) {
+    SendFrame(fd, kStderrFrame, message.data(), message.size()) && SendStatus(fd, 1);
+}
+
+// Client side, send the command line and print what comes
+// back until the request is done. Returns its exit status.
+int Forward(const string& socket_path, int argc, char **argv) {
+    sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || !MakeAddress(socket_path, addr) ||
+        connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        cerr << "Could not connect to csv SERVE on " << socket_path << ".\n";
+        return 1;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        cerr << "Could not get the working directory.\n";
+        return 1;
+    }
+
+    string request(cwd);
+    request.push_back('\0');
+    for (int i = 1; i < argc; ++i) {
+        request += argv[i];
+        request.push_back('\0');
+    }
+    if (!WriteAll(fd, request.data(), request.size())) {
+        cerr << "Could not send the request to " << socket_path << ".\n";
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    char head[1 + sizeof(uint32_t)];
+    string data;
+    while (ReadAll(fd, head, sizeof(head))) {
+        uint32_t len;
+        memcpy(&len, head + 1, sizeof(len));
+        data.resize(len);
+        if (!ReadAll(fd, &data[0], len)) {
+            break;
+        }
+        if (head[0] == kExitFrame && len == sizeof(int32_t)) {
+            int32_t status;
+            memcpy(&status, data.data(), sizeof(status));
+            close(fd);
+            return status;
+        }
+        WriteAll(head[0] == kStdoutFrame ? 1 : 2, data.data(), len);
+    }
+    close(fd);
+    cerr << "Lost the connection to csv SERVE on " << socket_path << ".\n";
+    return 1;
+}
+
+// A connection whose request is still coming in.
+struct PendingRequest {
+    int fd;
+    string data;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// Split a whole request, args gets argv[0] and the arguments.
+bool ParseRequest(const string& request, string& cwd, vector<string>& args) {
+    args.assign(1, "csv");
+    size_t start = 0;
+    size_t end;
+    while ((end = request.find('\0', start)) != string::npos) {
+        args.push_back(request.substr(start, end - start));
+        start = end + 1;
+    }
+    if (args.size() < 3) {
+        return false; // no working directory or command
+    }
+    cwd = args[1];
+    args.erase(args.begin() + 1);
+    return true;
+}
+
+// getopt reorders argv, every parse gets a fresh one.
+vector<char*> MakeArgv(vector<string>& args) {
+    vector<char*> argv;
+    for (auto &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+    return argv;
+}
+
+// Runs warm jobs on a thread of its own, one after the
+// other, so parsing a large table never holds up requests.
+class Warmer {
+public:
+    static const size_t kMaxQueued = 64;
+
+    Warmer () {
+        thread(&Warmer::Work, this).detach();
+    }
+
+    // Dropped when the warmer is too far behind.
+    void Add (WarmJob job) {
+        if (!job) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (queue_.size() >= kMaxQueued) {
+                return;
+            }
+            queue_.push_back(std::move(job));
+        }
+        not_empty_.notify_one();
+    }
+
+private:
+    void Work () {
+        while (true) {
+            WarmJob job;
+            {
+                unique_lock<mutex> lock(mutex_);
+                not_empty_.wait(lock, [this] { return !queue_.empty(); });
+                job = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            job();
+        }
+    }
+
+    mutex mutex_;
+    condition_variable not_empty_;
+    deque<WarmJob> queue_;
+};
+
+// Copy the output of a request to the client until both
+// pipes are closed. Returns whether it printed to stderr.
+bool Relay(int out_fd, int err_fd, int fd) {
+    pollfd fds[2] = {{out_fd, POLLIN, 0}, {err_fd, POLLIN, 0}};
+    bool printed_error = false;
+    int num_open = 2;
+    char buf[1 << 16];
+    while (num_open > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].fd < 0 || !fds[i].revents) {
+                continue;
+            }
+            ssize_t len = read(fds[i].fd, buf, sizeof(buf));
+            if (len <= 0) {
+                fds[i].fd = -1; // poll skips it
+                --num_open;
+                continue;
+            }
+            printed_error |= (i == 1);
+            SendFrame(fd, i == 0 ? kStdoutFrame : kStderrFrame, buf, len);
+        }
+    }
+    return printed_error;
+}
+
+int32_t StartFailed(int fd) {
+    string message = "Could not start the request.\n";
+    SendFrame(fd, kStderrFrame, message.data(), message.size());
+    return 1;
+}
+
+// Run the request in a process of its own with its stdout
+// and stderr relayed to the client. Returns its exit status.
+// Errors print to stderr and exit(0), so a request which
+// printed to stderr failed whatever its status.
+int32_t RunRequest(int fd, const string& cwd, vector<string>& args, CommandFn run) {
+    int out[2];
+    int err[2];
+    if (pipe(out) != 0 || pipe(err) != 0) {
+        return StartFailed(fd);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fd);
+        dup2(out[1], 1);
+        dup2(err[1], 2);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        if (chdir(cwd.c_str()) != 0) {
+            cerr << "Bad working directory " << cwd << ".\n";
+            exit(1);
+        }
+        vector<char*> argv = MakeArgv(args);
+        optind = 0;
+        opterr = 1;
+        run(args.size(), argv.data());
+        exit(0);
+    }
+    close(out[1]);
+    close(err[1]);
+    if (pid < 0) {
+        return StartFailed(fd);
+    }
+
+    bool printed_error = Relay(out[0], err[0], fd);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    int32_t exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (exit_status == 0 && printed_error) {
+        exit_status = 1;
+    }
+    return exit_status;
+}
+
+// Fork the request off the server and run it.
+// warm_state is held across the fork.
+void StartRequest(int fd, const string& cwd, vector<string>& args, CommandFn run,
+                  mutex& warm_state, int listen_fd, const vector<PendingRequest>& pending) {
+    pid_t pid;
+    {
+        lock_guard<mutex> lock(warm_state);
+        pid = fork();
+    }
+
+    if (pid == 0) {
+        // Only this request's connection stays open.
+        close(listen_fd);
+        for (auto &other : pending) {
+            if (other.fd != fd) {
+                close(other.fd);
+            }
+        }
+        // The request is waited for, and ends with its
+        // client.
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        SendStatus(fd, RunRequest(fd, cwd, args, run));
+        // Not exit(), the cache is not worth freeing.
+        _exit(0);
+    } else if (pid < 0) {
+        SendError(fd, "Could not start the request.\n");
+    }
+}
+
+// Serve requests forever. Connections are polled together,
+// a request starts once its client has sent all of it, one
+// not complete within kRequestTimeout is dropped, so a slow
+// or idle client holds up nobody else.
+// prepare makes a warm job of every request, jobs run on a
+// thread of their own, what they cache stays for the next
+// requests, they must not exit. They change what requests
+// see only while holding warm_state. run executes the
+// request.
+void Serve(const string& socket_path, CommandFn run, PrepareFn prepare, mutex& warm_state) {
+    static const std::chrono::seconds kRequestTimeout(10);
+    static const size_t kMaxRequest = 1 << 20;
+
+    sockaddr_un addr;
+    if (!MakeAddress(socket_path, addr)) {
+        cerr << "Socket path " << socket_path << " is too long.\n";
+        exit(0);
+    }
+
+    // A socket left by an earlier server is replaced. Requests
+    // run as the server's user, so only it may connect, the
+    // socket is never open to others even before the chmod.
+    unlink(socket_path.c_str());
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t old_mask = umask(0177);
+    bool bound = listen_fd >= 0 &&
+                 bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        cerr << "Could not listen on " << socket_path << ".\n";
+        exit(0);
+    }
+
+    // Requests are waited for by the process they are forked
+    // into, not by the server. A client gone before its answer
+    // must not end the server.
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    Warmer warmer;
+    vector<PendingRequest> pending;
+    while (true) {
+        vector<pollfd> fds(1);
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        auto now = std::chrono::steady_clock::now();
+        int timeout_ms = -1;
+        for (auto &request : pending) {
+            pollfd p = {request.fd, POLLIN, 0};
+            fds.push_back(p);
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(request.deadline - now).count();
+            if (timeout_ms < 0 || left < timeout_ms) {
+                timeout_ms = std::max<int>(0, left);
+            }
+        }
+
+        if (poll(fds.data(), fds.size(), timeout_ms) < 0) {
+            continue;
+        }
+
+        now = std::chrono::steady_clock::now();
+        vector<PendingRequest> still_pending;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            PendingRequest& request = pending[i];
+            bool done = false;
+            if (fds[i + 1].revents) {
+                char buf[4096];
+                ssize_t len = read(request.fd, buf, sizeof(buf));
+                if (len > 0 && request.data.size() + len <= kMaxRequest) {
+                    request.data.append(buf, len);
+                } else {
+                    // The client is done sending at end of file,
+                    // anything else leaves no valid request.
+                    if (len != 0) {
+                        request.data.clear();
+                    }
+                    done = true;
+                }
+            }
+
+            string message;
+            if (done) {
+                string cwd;
+                vector<string> args;
+                if (ParseRequest(request.data, cwd, args)) {
+                    // Only this thread uses getopt.
+                    vector<char*> argv = MakeArgv(args);
+                    optind = 0;
+                    opterr = 0;
+                    warmer.Add(prepare(cwd, args.size(), argv.data()));
+                    StartRequest(request.fd, cwd, args, run, warm_state, listen_fd, pending);
+                } else {
+                    message = "Bad request.\n";
+                }
+            } else if (now >= request.deadline) {
+                message = "Request not received within the timeout.\n";
+                done = true;
+            }
+
+            if (done) {
+                if (!message.empty()) {
+                    SendError(request.fd, message);
+                }
+                close(request.fd);
+            } else {
+                still_pending.push_back(std::move(request));
+            }
+        }
+        pending.swap(still_pending);
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0) {
+                PendingRequest request = {fd, string(), now + kRequestTimeout};
+                pending.push_back(request);
+            }
+        }
+    }
+}
+
+} } //namespace
+#endif
@@ -0,0 +1,224 @@
+#ifndef _CSV_SORT_
+#define _CSV_SORT_
+
+#include <array>
+#include <queue>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include "util.h"
+
+using namespace std;
+namespace csv { namespace sort {
+
+// Sorting works on entries, not rows. An entry is a fixed
+// run of 32 bit words
+//   key_0 .. key_n-1, offset (low, high), length
+// where the keys are biased so their unsigned order is their
+// signed order, and offset/length locate the row in the
+// input. Rows are never re-parsed or moved, only written out
+// in entry order at the end.
+
+inline uint32_t BiasKey (int key) {
+    return static_cast<uint32_t>(key) ^ 0x80000000U;
+}
+
+// Stable LSD radix sort of the entries on their key words,
+// 8 bits a pass, last key first. Each pass histograms and
+// scatters contiguous slices on num_threads threads, every
+// thread writing to its own precomputed offsets. Passes where
+// all entries share the digit are skipped.
+void RadixSort (vector<uint32_t>& entries, size_t stride, size_t num_keys, size_t num_threads) {
+    size_t num_entries = entries.size() / stride;
+    if (num_entries < 2) {
+        return;
+    }
+
+    num_threads = std::max<size_t>(1, std::min(num_threads, num_entries / 4096 + 1));
+    vector<uint32_t> buffer(entries.size());
+    vector<array<size_t, 256>> counts(num_threads);
+
+    for (size_t key = num_keys; key-- > 0;) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            csv::util::RunParallel(num_threads, [&](size_t t) {
+                counts[t].fill(0);
+                size_t end = num_entries * (t + 1) / num_threads;
+                for (size_t i = num_entries * t / num_threads; i < end; ++i) {
+                    counts[t][(entries[i * stride + key] >> shift) & 0xFF]++;
+                }
+            });
+
+            bool single_digit = false;
+            size_t pos = 0;
+            for (size_t digit = 0; digit < 256; ++digit) {
+                size_t digit_count = 0;
+                for (size_t t = 0; t < num_threads; ++t) {
+                    size_t count = counts[t][digit];
+                    counts[t][digit] = pos;
+                    pos += count;
+                    digit_count += count;
+                }
+                single_digit = single_digit || (digit_count == num_entries);
+            }
+            if (single_digit) {
+                continue;
+            }
+
+            csv::util::RunParallel(num_threads, [&](size_t t) {
+                size_t end = num_entries * (t + 1) / num_threads;
+                for (size_t i = num_entries * t / num_threads; i < end; ++i) {
+                    const uint32_t* entry = &entries[i * stride];
+                    size_t dest = counts[t][(entry[key] >> shift) & 0xFF]++;
+                    memcpy(&buffer[dest * stride], entry, stride * sizeof(uint32_t));
+                }
+            });
+            entries.swap(buffer);
+        }
+    }
+}
+
+// Sorts entries within a memory budget. Entries are collected
+// until half the budget is used (the radix sort needs as much
+// again), then sorted and spilled to a run file. Merge does a
+// k-way merge of the runs, ties go to the earlier run, so the
+// sort is stable overall.
+struct ExternalSort {
+    ExternalSort (size_t num_keys, size_t memory_budget,
+                  size_t num_threads, const string& run_prefix)
+        : num_keys_(num_keys), stride_(num_keys + 3),
+          memory_budget_(memory_budget), num_threads_(num_threads),
+          run_prefix_(run_prefix)
+    {}
+
+    ~ExternalSort () {
+        for (auto &run_file : run_files_) {
+            remove(run_file.c_str());
+        }
+    }
+
+    size_t GetStride() const {
+        return stride_;
+    }
+
+    void Add (const vector<uint32_t>& entries) {
+        entries_.insert(entries_.end(), entries.begin(), entries.end());
+        if (entries_.size() * sizeof(uint32_t) * 2 > memory_budget_) {
+            SpillRun();
+        }
+    }
+
+    // Calls emit(offset, length) for every entry in key order.
+    template <typename Fn>
+    void Merge (Fn emit) {
+        if (run_files_.empty()) {
+            RadixSort(entries_, stride_, num_keys_, num_threads_);
+            for (size_t i = 0; i < entries_.size(); i += stride_) {
+                emit(Offset(&entries_[i]), entries_[i + num_keys_ + 2]);
+            }
+            return;
+        }
+
+        if (!entries_.empty()) {
+            SpillRun();
+        }
+
+        vector<RunReader> runs;
+        for (auto &run_file : run_files_) {
+            runs.push_back(RunReader(run_file, stride_));
+        }
+
+        size_t num_keys = num_keys_;
+        auto later = [&](size_t a, size_t b) {
+            int order = 0;
+            for (size_t k = 0; k < num_keys && order == 0; ++k) {
+                uint32_t key_a = runs[a].Current()[k];
+                uint32_t key_b = runs[b].Current()[k];
+                order = (key_a < key_b) ? -1 : (key_a > key_b);
+            }
+            return order ? order > 0 : a > b;
+        };
+
+        priority_queue<size_t, vector<size_t>, decltype(later)> heap(later);
+        for (size_t i = 0; i < runs.size(); ++i) {
+            if (runs[i].Next()) {
+                heap.push(i);
+            }
+        }
+
+        while (!heap.empty()) {
+            size_t run = heap.top();
+            heap.pop();
+            const uint32_t* entry = runs[run].Current();
+            emit(Offset(entry), entry[num_keys_ + 2]);
+            if (runs[run].Next()) {
+                heap.push(run);
+            }
+        }
+    }
+
+private:
+    // Buffered reader over a spilled run.
+    struct RunReader {
+        RunReader (const string& file_name, size_t stride)
+            : file_(new ifstream(file_name.c_str(), std::ifstream::binary)),
+              stride_(stride), pos_(0), end_(0)
+        {}
+
+        bool Next () {
+            pos_ += stride_;
+            if (pos_ < end_) {
+                return true;
+            }
+
+            buffer_.resize(stride_ * 16384);
+            file_->read(reinterpret_cast<char*>(buffer_.data()), buffer_.size() * sizeof(uint32_t));
+            end_ = file_->gcount() / sizeof(uint32_t);
+            pos_ = 0;
+            return end_ >= stride_;
+        }
+
+        const uint32_t* Current () const {
+            return &buffer_[pos_];
+        }
+
+    private:
+        shared_ptr<ifstream> file_;
+        size_t stride_;
+        vector<uint32_t> buffer_;
+        size_t pos_;
+        size_t end_;
+    };
+
+    uint64_t Offset (const uint32_t* entry) const {
+        return entry[num_keys_] | (static_cast<uint64_t>(entry[num_keys_ + 1]) << 32);
+    }
+
+    void SpillRun () {
+        RadixSort(entries_, stride_, num_keys_, num_threads_);
+
+        string run_file = run_prefix_ + to_string(run_files_.size());
+        ofstream run_write(run_file.c_str(), std::ofstream::binary);
+        run_write.write(reinterpret_cast<const char*>(entries_.data()),
+                        entries_.size() * sizeof(uint32_t));
+        if (!run_write) {
+            cerr << "Could not write sort run " << run_file << ".\n";
+            exit(0);
+        }
+        run_files_.push_back(run_file);
+        entries_.clear();
+    }
+
+    size_t num_keys_;
+    size_t stride_;
+    size_t memory_budget_;
+    size_t num_threads_;
+    string run_prefix_;
+    vector<uint32_t> entries_;
+    vector<string> run_files_;
+};
+
+} } //namespace
+#endif
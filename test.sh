@@ -0,0 +1,16 @@
+#!/bin/sh
+# Build and run the tests in tests/, warnings fail the build.
+# Tests run under AddressSanitizer and UBSan, the pipeline
+# test once more under ThreadSanitizer.
+set -e
+mkdir -p _test
+for test in tests/*_test.cpp; do
+    name=$(basename $test .cpp)
+    g++ -g -Wall -Wextra -Werror -fsanitize=address,undefined -o _test/$name $test --std=c++20 -pthread
+    ./_test/$name
+done
+
+# TSan does not model the channel's fences, it warns about them.
+g++ -g -O1 -Wall -Wextra -Werror -Wno-tsan -fsanitize=thread -o _test/pipeline_test_tsan tests/pipeline_test.cpp --std=c++20 -pthread
+TSAN_OPTIONS=halt_on_error=1 ./_test/pipeline_test_tsan
+echo "All tests passed."
@@ -0,0 +1,74 @@
+#include "check.h"
+#include "../util.h"
+
+using namespace csv::util;
+using namespace csv::test;
+
+// Every allocation of this test starts 16 bytes past a cache
+// line and ends where ASan poisons, so a filter aligning its
+// blocks past the end of its storage is caught.
+void* operator new (size_t size) {
+    void* base;
+    if (posix_memalign(&base, 64, size + 16) != 0) {
+        throw std::bad_alloc();
+    }
+    return static_cast<char*>(base) + 16;
+}
+
+void operator delete (void* p) noexcept {
+    if (p) {
+        free(static_cast<char*>(p) - 16);
+    }
+}
+
+void operator delete (void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+void TestNoFalseNegatives () {
+    for (size_t num_keys : {0, 1, 7, 1000, 100000}) {
+        BloomFilter filter(num_keys);
+        for (size_t key = 0; key < num_keys; ++key) {
+            filter.Add(HashInt(key));
+        }
+        for (size_t key = 0; key < num_keys; ++key) {
+            CHECK(filter.MayContain(HashInt(key)));
+        }
+    }
+}
+
+// 16 bits per key in 256 bit blocks gives about 0.13%.
+// Sizing blocks as 512 bits gave 3.4%.
+void TestFalsePositiveRate () {
+    const size_t num_keys = 100000;
+    const size_t num_probes = 1000000;
+    BloomFilter filter(num_keys);
+    for (size_t key = 0; key < num_keys; ++key) {
+        filter.Add(HashInt(key));
+    }
+
+    size_t false_positives = 0;
+    for (size_t probe = 0; probe < num_probes; ++probe) {
+        false_positives += filter.MayContain(HashInt(num_keys + probe)) ? 1 : 0;
+    }
+    CHECK(false_positives * 1000 < num_probes * 3);
+}
+
+// The aligned blocks end inside the buffer, at every size.
+void TestResizeStaysInBounds () {
+    BloomFilter filter;
+    for (size_t num_keys = 0; num_keys < 300; ++num_keys) {
+        filter.Reset(num_keys);
+        for (uint64_t hash : {0ULL, ~0ULL, 0xFFFFFFFF00000000ULL, 0x00000000FFFFFFFFULL}) {
+            filter.Add(hash);
+            CHECK(filter.MayContain(hash));
+        }
+    }
+}
+
+int main () {
+    RUN_TEST(TestNoFalseNegatives);
+    RUN_TEST(TestFalsePositiveRate);
+    RUN_TEST(TestResizeStaysInBounds);
+    return 0;
+}
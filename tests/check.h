@@ -0,0 +1,97 @@
+#ifndef _CSV_TEST_CHECK_
+#define _CSV_TEST_CHECK_
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <filesystem>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+using namespace std;
+namespace csv { namespace test {
+
+// Checks stop the test binary on the first failure.
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed\n"; \
+            exit(1); \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        auto check_a = (a); \
+        auto check_b = (b); \
+        if (!(check_a == check_b)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #a ", " #b ") failed\n" \
+                 << "  got:      " << check_a << "\n  expected: " << check_b << "\n"; \
+            exit(1); \
+        } \
+    } while (0)
+
+// Scratch directory of the test binary, removed when it
+// exits (not when a child forked by ErrorOf does).
+string TempDir () {
+    static string dir;
+    static pid_t owner;
+    if (dir.empty()) {
+        char name[] = "/tmp/csv_test_XXXXXX";
+        dir = mkdtemp(name);
+        owner = getpid();
+        atexit([] {
+            if (getpid() == owner) {
+                std::filesystem::remove_all(dir);
+            }
+        });
+    }
+    return dir;
+}
+
+string TempFile (const string& name) {
+    return TempDir() + "/" + name;
+}
+
+void WriteFile (const string& file_name, const string& contents) {
+    ofstream file(file_name.c_str(), std::ofstream::binary);
+    file << contents;
+}
+
+string ReadFile (const string& file_name) {
+    ifstream file(file_name.c_str(), std::ifstream::binary);
+    stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// Errors print to stderr and exit(0), so fn runs in a child.
+// Returns what it printed, empty if fn returned instead.
+string ErrorOf (const function<void()>& fn) {
+    string error_file = TempFile("error.txt");
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(error_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(fd, 2);
+        close(fd);
+        fn();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return ReadFile(error_file);
+}
+
+#define RUN_TEST(fn) \
+    do { \
+        fn(); \
+        cout << "OK " #fn "\n"; \
+    } while (0)
+
+} } //namespace
+#endif
@@ -0,0 +1,77 @@
+#include "check.h"
+#include "../col_compute.h"
+
+using namespace csv::test;
+
+// One incremental COMPUTE run of expression over in.csv.
+string Run (const string& expression, const string& filter = string()) {
+    string input = TempFile("in.csv");
+    string output = TempFile("out.csv");
+    string compute_expression = expression;
+    string filter_expression = filter;
+    csv::compute::CSVCompute::Evaluate(input, compute_expression, filter_expression, output,
+                                       true, TempFile("checkpoint"));
+    return ReadFile(output);
+}
+
+void Reset () {
+    remove(TempFile("out.csv").c_str());
+    remove(TempFile("checkpoint").c_str());
+}
+
+void TestResumesAppendedRows () {
+    Reset();
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n3,4\n");
+    CHECK_EQ(Run("A+B"), "A,B,result\n1,2,3\n3,4,7\n");
+
+    // Only the new rows are evaluated, a trailing line
+    // without its newline waits for the next run.
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n3,4\n5,6\n7,");
+    CHECK_EQ(Run("A+B"), "A,B,result\n1,2,3\n3,4,7\n5,6,11\n");
+
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n3,4\n5,6\n7,8\n");
+    CHECK_EQ(Run("A+B"), "A,B,result\n1,2,3\n3,4,7\n5,6,11\n7,8,15\n");
+
+    // Nothing appended, nothing changes.
+    CHECK_EQ(Run("A+B"), "A,B,result\n1,2,3\n3,4,7\n5,6,11\n7,8,15\n");
+}
+
+// Same header, other rows, the checkpoint must not match.
+void TestRewrittenInputStartsOver () {
+    Reset();
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n3,4\n");
+    Run("A+B");
+
+    WriteFile(TempFile("in.csv"), "A,B\n100,200\n300,400\n500,600\n700,800\n");
+    CHECK_EQ(Run("A+B"), "A,B,result\n100,200,300\n300,400,700\n500,600,1100\n700,800,1500\n");
+}
+
+void TestChangedCommandStartsOver () {
+    Reset();
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n3,4\n");
+    Run("A+B");
+
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n3,4\n5,6\n");
+    CHECK_EQ(Run("A*B"), "A,B,result\n1,2,2\n3,4,12\n5,6,30\n");
+    CHECK_EQ(Run("A*B", "result"), "result\n2\n12\n30\n");
+}
+
+// A run that died after writing output but before saving
+// its checkpoint leaves output the next run drops.
+void TestDropsOutputOfUnsavedRun () {
+    Reset();
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n");
+    Run("A+B");
+
+    WriteFile(TempFile("out.csv"), ReadFile(TempFile("out.csv")) + "9,9,18\n");
+    WriteFile(TempFile("in.csv"), "A,B\n1,2\n3,4\n");
+    CHECK_EQ(Run("A+B"), "A,B,result\n1,2,3\n3,4,7\n");
+}
+
+int main () {
+    RUN_TEST(TestResumesAppendedRows);
+    RUN_TEST(TestRewrittenInputStartsOver);
+    RUN_TEST(TestChangedCommandStartsOver);
+    RUN_TEST(TestDropsOutputOfUnsavedRun);
+    return 0;
+}
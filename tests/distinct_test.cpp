@@ -0,0 +1,119 @@
+#include <random>
+#include <set>
+#include "check.h"
+#include "../col_compute.h"
+
+using namespace csv::test;
+
+string Distinct (const string& filter, size_t memory_budget, size_t num_threads, bool keep_order) {
+    string input = TempFile("in.csv");
+    string output = TempFile("out.csv");
+    string filter_expression = filter;
+    csv::compute::CSVCompute::Distinct(input, output, filter_expression, true, ',',
+                                       memory_budget, num_threads, keep_order);
+    return ReadFile(output);
+}
+
+// Rows of (a, b) with many repeats, b quoted in some of them.
+vector<string> RandomRows (size_t num_rows) {
+    std::mt19937 random(4);
+    vector<string> rows;
+    for (size_t i = 0; i < num_rows; ++i) {
+        string a = to_string(random() % 500);
+        string b = to_string(random() % 10);
+        rows.push_back(a + "," + (random() % 3 == 0 ? "\"" + b + "\"" : b));
+    }
+    return rows;
+}
+
+string Unquoted (const string& row) {
+    string text;
+    for (auto &c : row) {
+        if (c != '"') {
+            text.push_back(c);
+        }
+    }
+    return text;
+}
+
+// The first row of each key, in input order.
+string FirstOfEach (const vector<string>& rows, const function<string(const string&)>& key) {
+    set<string> seen;
+    string csv = "a,b\n";
+    for (auto &row : rows) {
+        if (seen.insert(key(row)).second) {
+            csv += row + "\n";
+        }
+    }
+    return csv;
+}
+
+string ToCsv (const vector<string>& rows) {
+    string csv = "a,b\n";
+    for (auto &row : rows) {
+        csv += row + "\n";
+    }
+    return csv;
+}
+
+// Rows are compared on their unquoted cells, a cell holding
+// a delimiter is still one cell.
+void TestQuotedRowsMatch () {
+    WriteFile(TempFile("in.csv"), "a,b\n\"x\",y\nx,y\nx,\"y\"\n\"x,y\"\nx,y,\n\"q\"\"q\",1\n\"q\"\"q\",\"1\"\n");
+    CHECK_EQ(Distinct("", 1 << 30, 2, true), "a,b\n\"x\",y\n\"x,y\"\nx,y,\n\"q\"\"q\",1\n");
+}
+
+void TestKeyColumns () {
+    WriteFile(TempFile("in.csv"), "a,b\n1,x\n2,y\n\"1\",z\n3,x\n");
+    CHECK_EQ(Distinct("a", 1 << 30, 2, true), "a,b\n1,x\n2,y\n3,x\n");
+    CHECK_EQ(Distinct("b", 1 << 30, 2, true), "a,b\n1,x\n2,y\n\"1\",z\n");
+}
+
+void TestKeepsFirstOfEach () {
+    vector<string> rows = RandomRows(20000);
+    WriteFile(TempFile("in.csv"), ToCsv(rows));
+    string first_of_each = FirstOfEach(rows, Unquoted);
+    string first_by_a = FirstOfEach(rows, [](const string& row) { return row.substr(0, row.find(',')); });
+
+    for (size_t num_threads : {1, 4}) {
+        CHECK_EQ(Distinct("", 1 << 30, num_threads, true), first_of_each);
+        CHECK_EQ(Distinct("a", 1 << 30, num_threads, true), first_by_a);
+
+        // Without keep_order the same rows, grouped by hash.
+        string grouped = Distinct("", 1 << 30, num_threads, false);
+        CHECK_EQ(grouped.size(), first_of_each.size());
+        istringstream lines(grouped);
+        multiset<string> got;
+        multiset<string> expected;
+        string line;
+        while (getline(lines, line)) {
+            got.insert(line);
+        }
+        istringstream expected_lines(first_of_each);
+        while (getline(expected_lines, line)) {
+            expected.insert(line);
+        }
+        CHECK(got == expected);
+    }
+}
+
+// A small budget spills partitions and sort runs to disk,
+// the result is the same and the spill files are removed.
+void TestSpilledPartitions () {
+    vector<string> rows = RandomRows(20000);
+    WriteFile(TempFile("in.csv"), ToCsv(rows));
+    CHECK_EQ(Distinct("", 64 << 10, 3, true), FirstOfEach(rows, Unquoted));
+
+    for (auto &entry : std::filesystem::directory_iterator(TempDir())) {
+        string name = entry.path().filename();
+        CHECK(name == "in.csv" || name == "out.csv");
+    }
+}
+
+int main () {
+    RUN_TEST(TestQuotedRowsMatch);
+    RUN_TEST(TestKeyColumns);
+    RUN_TEST(TestKeepsFirstOfEach);
+    RUN_TEST(TestSpilledPartitions);
+    return 0;
+}
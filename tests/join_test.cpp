@@ -0,0 +1,66 @@
+#include "check.h"
+#include "../col_compute.h"
+
+using namespace csv::test;
+
+// JOIN of left.csv and right.csv on id = rid.
+string Join (bool is_outer, char delimiter = ',', const string& filter = string()) {
+    string left = TempFile("left.csv");
+    string right = TempFile("right.csv");
+    string output = TempFile("out.csv");
+    string col_left = "id";
+    string col_right = "rid";
+    csv::compute::CSVCompute::Join(left, right, output, col_left, col_right,
+                                   true, is_outer, delimiter, filter);
+    return ReadFile(output);
+}
+
+void TestJoin () {
+    WriteFile(TempFile("left.csv"), "id,x\n1,10\n2,20\n3,30\n");
+    WriteFile(TempFile("right.csv"), "rid,v\n1,100\n3,300\n3,301\n");
+    CHECK_EQ(Join(false), "id,x,rid,v\n1,10,1,100\n3,30,3,300\n3,30,3,301\n");
+    CHECK_EQ(Join(true), "id,x,rid,v\n1,10,1,100\n2,20,0,0\n3,30,3,300\n3,30,3,301\n");
+}
+
+// No joined rows, no header, as with the other commands.
+void TestEmptyResultHasNoHeader () {
+    WriteFile(TempFile("left.csv"), "id,x\n1,10\n");
+    WriteFile(TempFile("right.csv"), "rid,v\n2,20\n");
+    CHECK_EQ(Join(false), "");
+    CHECK_EQ(Join(true), "id,x,rid,v\n1,10,0,0\n");
+}
+
+// Short rows get 0 for their missing cells, on the path
+// copying whole rows and on the one copying cells, so the
+// columns after them stay in place.
+void TestRaggedRows () {
+    WriteFile(TempFile("left.csv"), "id,x,y\n1,10\n2,20,21,22\n");
+    WriteFile(TempFile("right.csv"), "rid,v,w\n1\n2,200,201\n");
+    string joined = "id,x,y,rid,v,w\n1,10,0,1,0,0\n2,20,21,2,200,201\n";
+    CHECK_EQ(Join(false), joined);
+
+    // Only some columns, the cells are copied one by one.
+    CHECK_EQ(Join(false, ',', "id,y,w"), "id,y,w\n1,0,0\n2,21,201\n");
+
+    // Another delimiter, the cells are copied one by one.
+    WriteFile(TempFile("left.csv"), "id\tx\ty\n1\t10\n2\t20\t21\t22\n");
+    WriteFile(TempFile("right.csv"), "rid\tv\tw\n1\n2\t200\t201\n");
+    CHECK_EQ(Join(false, '\t'), joined);
+}
+
+// Cells of input with another delimiter are quoted for the
+// comma separated output when they need it.
+void TestRequotesCells () {
+    WriteFile(TempFile("left.csv"), "id\tname\n1\tfoo,bar\n2\tsays \"hi\"\n");
+    WriteFile(TempFile("right.csv"), "rid\tcity\n1\tNew York, NY\n2\t\"a\tb\"\n");
+    CHECK_EQ(Join(false, '\t'),
+             "id,name,rid,city\n1,\"foo,bar\",1,\"New York, NY\"\n2,\"says \"\"hi\"\"\",2,\"a\tb\"\n");
+}
+
+int main () {
+    RUN_TEST(TestJoin);
+    RUN_TEST(TestEmptyResultHasNoHeader);
+    RUN_TEST(TestRaggedRows);
+    RUN_TEST(TestRequotesCells);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include <thread>
+#include "check.h"
+#include "../pipeline.h"
+
+using namespace csv::pipeline;
+using namespace csv::test;
+
+void TestQueueFullAndEmpty () {
+    BoundedQueue<int> queue(4);
+    int value = 0;
+    CHECK(!queue.TryPop(value));
+    for (int i = 0; i < 4; ++i) {
+        value = i;
+        CHECK(queue.TryPush(value));
+    }
+    value = 4;
+    CHECK(!queue.TryPush(value));
+    for (int i = 0; i < 4; ++i) {
+        CHECK(queue.TryPop(value));
+        CHECK_EQ(value, i);
+    }
+    CHECK(!queue.TryPop(value));
+}
+
+// Producers and consumers spinning on a small queue, every
+// value comes out exactly once, and those of one producer in
+// the order it pushed them.
+void TestQueueManyProducersAndConsumers () {
+    const size_t kProducers = 4;
+    const size_t kConsumers = 4;
+    const size_t kPerProducer = 100000;
+    BoundedQueue<size_t> queue(16);
+    vector<vector<size_t>> popped(kConsumers);
+    atomic<size_t> num_popped(0);
+
+    vector<thread> threads;
+    for (size_t p = 0; p < kProducers; ++p) {
+        threads.emplace_back([&, p] {
+            for (size_t i = 0; i < kPerProducer; ++i) {
+                size_t value = p * kPerProducer + i;
+                while (!queue.TryPush(value)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (size_t c = 0; c < kConsumers; ++c) {
+        threads.emplace_back([&, c] {
+            size_t value;
+            while (num_popped.load() < kProducers * kPerProducer) {
+                if (queue.TryPop(value)) {
+                    popped[c].push_back(value);
+                    num_popped++;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    vector<int> seen(kProducers * kPerProducer, 0);
+    for (auto &values : popped) {
+        vector<size_t> last(kProducers, 0);
+        for (auto &value : values) {
+            seen[value]++;
+            size_t p = value / kPerProducer;
+            CHECK(last[p] <= value);
+            last[p] = value;
+        }
+    }
+    for (auto &count : seen) {
+        CHECK_EQ(count, 1);
+    }
+}
+
+Task Produce (Channel<size_t>& channel, size_t first, size_t count) {
+    for (size_t i = first; i < first + count; ++i) {
+        co_await channel.Push(i);
+    }
+    channel.Close();
+}
+
+Task Consume (Channel<size_t>& channel, vector<atomic<int>>& seen) {
+    size_t value;
+    while (co_await channel.Pop(value)) {
+        seen[value]++;
+    }
+}
+
+// More stages than threads on a channel smaller than any
+// of them needs, so stages keep parking and handing over.
+void TestChannel () {
+    const size_t kPerProducer = 20000;
+    for (size_t num_threads = 1; num_threads <= 8; ++num_threads) {
+        size_t num_producers = 1 + num_threads % 3;
+        Executor executor(num_threads);
+        Channel<size_t> channel(executor, 2, num_producers);
+        vector<atomic<int>> seen(num_producers * kPerProducer);
+        for (size_t p = 0; p < num_producers; ++p) {
+            executor.Spawn(Produce(channel, p * kPerProducer, kPerProducer));
+        }
+        for (size_t c = 0; c < 3; ++c) {
+            executor.Spawn(Consume(channel, seen));
+        }
+        executor.Run();
+
+        for (auto &count : seen) {
+            CHECK_EQ(count.load(), 1);
+        }
+    }
+}
+
+// Chunks come back in input order whatever the thread count
+// and however the map stages overtake each other.
+void TestRunStagesKeepsOrder () {
+    for (size_t num_threads = 1; num_threads <= 9; ++num_threads) {
+        stringstream input;
+        string expected = "doubled\n";
+        size_t num_records = 50000 + num_threads * 777;
+        for (size_t i = 0; i < num_records; ++i) {
+            input << i << "\n";
+            expected += to_string(i * 2) + "\n";
+        }
+
+        stringstream output;
+        bool header_written = false;
+        RunStages(input, csv::util::Tokenizer(), [](const RecordBatch& batch, OutputChunk& chunk) {
+            chunk.header = "doubled";
+            for (auto &record : batch.records) {
+                chunk.text += to_string(atoll(record.c_str()) * 2) + "\n";
+            }
+        }, output, header_written, num_threads);
+        CHECK_EQ(output.str(), expected);
+        CHECK(header_written);
+    }
+}
+
+// No rows, no header.
+void TestRunStagesEmpty () {
+    stringstream input;
+    stringstream output;
+    bool header_written = false;
+    RunStages(input, csv::util::Tokenizer(), [](const RecordBatch&, OutputChunk& chunk) {
+        chunk.header = "doubled";
+    }, output, header_written, 4);
+    CHECK_EQ(output.str(), "");
+    CHECK(!header_written);
+}
+
+int main () {
+    RUN_TEST(TestQueueFullAndEmpty);
+    RUN_TEST(TestQueueManyProducersAndConsumers);
+    RUN_TEST(TestChannel);
+    RUN_TEST(TestRunStagesKeepsOrder);
+    RUN_TEST(TestRunStagesEmpty);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <random>
+#include "check.h"
+#include "../col_compute.h"
+
+using namespace csv::test;
+
+string Sort (const string& keys, size_t memory_budget, size_t num_threads) {
+    string input = TempFile("in.csv");
+    string output = TempFile("out.csv");
+    string key_expression = keys;
+    csv::compute::CSVCompute::Sort(input, output, key_expression, true, ',',
+                                   memory_budget, num_threads);
+    return ReadFile(output);
+}
+
+struct Row {
+    int a;
+    int b;
+    string text;
+};
+
+// Rows with few distinct keys, so ties are common and show
+// whether the sort is stable, some spanning two lines.
+vector<Row> RandomRows (size_t num_rows) {
+    std::mt19937 random(3);
+    vector<Row> rows;
+    for (size_t i = 0; i < num_rows; ++i) {
+        Row row;
+        row.a = static_cast<int>(random() % 21) - 10;
+        row.b = static_cast<int>(random() % 2000001) - 1000000;
+        row.text = (i % 17 == 0) ? "\"row " + to_string(i) + "\nsecond line\"" : "row" + to_string(i);
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+string ToCsv (const vector<Row>& rows) {
+    string csv = "a,b,text\n";
+    for (auto &row : rows) {
+        csv += to_string(row.a) + "," + to_string(row.b) + "," + row.text + "\n";
+    }
+    return csv;
+}
+
+void TestSortsLikeStableSort () {
+    vector<Row> rows = RandomRows(20000);
+    WriteFile(TempFile("in.csv"), ToCsv(rows));
+
+    vector<Row> by_a = rows;
+    std::stable_sort(by_a.begin(), by_a.end(), [](const Row& x, const Row& y) { return x.a < y.a; });
+    vector<Row> by_a_b = rows;
+    std::stable_sort(by_a_b.begin(), by_a_b.end(), [](const Row& x, const Row& y) {
+        return x.a != y.a ? x.a < y.a : x.b < y.b;
+    });
+
+    for (size_t num_threads : {1, 4}) {
+        CHECK_EQ(Sort("a", 1 << 30, num_threads), ToCsv(by_a));
+        CHECK_EQ(Sort("a,b", 1 << 30, num_threads), ToCsv(by_a_b));
+    }
+}
+
+// A small budget spills sorted runs which are merged, ties
+// still keep input order across runs.
+void TestSpilledRuns () {
+    vector<Row> rows = RandomRows(20000);
+    WriteFile(TempFile("in.csv"), ToCsv(rows));
+
+    vector<Row> by_a = rows;
+    std::stable_sort(by_a.begin(), by_a.end(), [](const Row& x, const Row& y) { return x.a < y.a; });
+    CHECK_EQ(Sort("a", 64 << 10, 3), ToCsv(by_a));
+
+    // Run files are removed.
+    for (auto &entry : std::filesystem::directory_iterator(TempDir())) {
+        string name = entry.path().filename();
+        CHECK(name == "in.csv" || name == "out.csv");
+    }
+}
+
+void TestEmptyInput () {
+    WriteFile(TempFile("in.csv"), "a,b,text\n");
+    CHECK_EQ(Sort("a", 1 << 30, 2), "a,b,text\n");
+}
+
+int main () {
+    RUN_TEST(TestSortsLikeStableSort);
+    RUN_TEST(TestSpilledRuns);
+    RUN_TEST(TestEmptyInput);
+    return 0;
+}
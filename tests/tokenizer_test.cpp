@@ -0,0 +1,161 @@
+#include <random>
+#include "check.h"
+#include "../util.h"
+
+using namespace csv::util;
+using namespace csv::test;
+
+vector<string> Fields (const Tokenizer& tokenizer, const string& record) {
+    vector<Slice> slices;
+    tokenizer.Split(record.data(), record.size(), slices);
+    vector<string> fields;
+    for (auto &slice : slices) {
+        fields.push_back(string(slice.data, slice.size));
+    }
+    return fields;
+}
+
+string Join (const vector<string>& fields) {
+    string joined;
+    for (auto &field : fields) {
+        joined += "[" + field + "]";
+    }
+    return joined;
+}
+
+// Byte at a time, what the quote masks must agree with.
+vector<string> ReferenceSplit (const string& record, char delimiter) {
+    vector<string> fields(1);
+    bool in_quotes = false;
+    for (auto &c : record) {
+        if (c == '"') {
+            in_quotes = !in_quotes;
+        }
+        if (c == delimiter && !in_quotes) {
+            fields.push_back(string());
+        } else {
+            fields.back().push_back(c);
+        }
+    }
+    return fields;
+}
+
+string RandomCsv (std::mt19937& random, size_t num_records) {
+    const char* cells[] = {"a", "", "12", "\"x,y\"", "\"line\nbreak\"", "\"q\"\"q\"",
+                           "\"\"", "long_cell_to_cross_the_64_byte_blocks_of_the_classifier"};
+    string csv;
+    for (size_t r = 0; r < num_records; ++r) {
+        size_t num_cells = 1 + random() % 6;
+        for (size_t c = 0; c < num_cells; ++c) {
+            csv += (c ? "," : "");
+            csv += cells[random() % 8];
+        }
+        csv += "\n";
+    }
+    return csv;
+}
+
+void TestSplit () {
+    Tokenizer tokenizer;
+    CHECK_EQ(Join(Fields(tokenizer, "a,b,c")), "[a][b][c]");
+    CHECK_EQ(Join(Fields(tokenizer, ",,")), "[][][]");
+    CHECK_EQ(Join(Fields(tokenizer, "")), "");
+    CHECK_EQ(Join(Fields(tokenizer, "\"a,b\",\"c\"\"d\",e")), "[\"a,b\"][\"c\"\"d\"][e]");
+    CHECK_EQ(Join(Fields(Tokenizer('\t'), "a,b\tc")), "[a,b][c]");
+
+    std::mt19937 random(1);
+    string csv = RandomCsv(random, 2000);
+    string record;
+    istringstream input(csv);
+    while (tokenizer.ReadRecord(input, record)) {
+        CHECK_EQ(Join(Fields(tokenizer, record)), Join(ReferenceSplit(record, ',')));
+    }
+}
+
+void TestField () {
+    Tokenizer tokenizer;
+    string record = "1,\"a,b\",3";
+    Slice field = tokenizer.Field(record.data(), record.size(), 1);
+    CHECK_EQ(string(field.data, field.size), "\"a,b\"");
+    field = tokenizer.Field(record.data(), record.size(), 2);
+    CHECK_EQ(string(field.data, field.size), "3");
+    field = tokenizer.Field(record.data(), record.size(), 5);
+    CHECK_EQ(field.size, 0u);
+}
+
+void TestQuoteRoundTrip () {
+    Tokenizer tokenizer;
+    for (string text : {"plain", "a,b", "say \"hi\"", "two\nlines", ""}) {
+        string quoted = tokenizer.Quote(text);
+        Slice slice = {quoted.data(), quoted.size()};
+        CHECK_EQ(tokenizer.Unquote(slice), text);
+    }
+    CHECK_EQ(tokenizer.Quote("plain"), "plain");
+    CHECK_EQ(tokenizer.Quote("a,b"), "\"a,b\"");
+}
+
+void TestReadRecord () {
+    Tokenizer tokenizer;
+    istringstream input("a,\"b\nc\",d\r\n\n\ne,f\n\"g\"\"\n\",h");
+    string record;
+    CHECK(tokenizer.ReadRecord(input, record));
+    CHECK_EQ(record, "a,\"b\nc\",d");
+    CHECK(tokenizer.ReadRecord(input, record));
+    CHECK_EQ(record, "e,f");
+    CHECK(tokenizer.ReadRecord(input, record));
+    CHECK_EQ(record, "\"g\"\"\n\",h");
+    CHECK(!tokenizer.ReadRecord(input, record));
+}
+
+// An open quote at the end of the input is reported, not
+// merged silently with the rest of the file.
+void TestUnterminatedQuote () {
+    Tokenizer tokenizer;
+    string error = ErrorOf([&] {
+        istringstream input("a,b\nc,\"d\ne,f\ng,h\n");
+        string record;
+        while (tokenizer.ReadRecord(input, record)) {
+        }
+    });
+    CHECK(error.find("Unterminated quoted field") != string::npos);
+    CHECK(error.find("c,\"d") != string::npos);
+
+    error = ErrorOf([&] {
+        string csv = "a,b\nc,\"d\ne,f\n";
+        tokenizer.ChunkBoundaries(csv.data(), csv.size(), 4);
+    });
+    CHECK(error.find("Unterminated quoted field") != string::npos);
+}
+
+// Chunks start exactly on record starts, whatever the count.
+void TestChunkBoundaries () {
+    Tokenizer tokenizer;
+    std::mt19937 random(2);
+    string csv = RandomCsv(random, 5000);
+
+    vector<size_t> record_starts;
+    for (size_t pos = 0; pos < csv.size(); pos += tokenizer.FindRecordEnd(csv.data() + pos, csv.size() - pos)) {
+        record_starts.push_back(pos);
+    }
+
+    for (size_t num_chunks : {1, 2, 3, 7, 16, 64, 1000}) {
+        vector<size_t> boundaries = tokenizer.ChunkBoundaries(csv.data(), csv.size(), num_chunks);
+        CHECK_EQ(boundaries.front(), 0u);
+        CHECK_EQ(boundaries.back(), csv.size());
+        CHECK(boundaries.size() <= num_chunks + 1);
+        for (size_t i = 0; i + 1 < boundaries.size(); ++i) {
+            CHECK(boundaries[i] < boundaries[i + 1]);
+            CHECK(std::binary_search(record_starts.begin(), record_starts.end(), boundaries[i]));
+        }
+    }
+}
+
+int main () {
+    RUN_TEST(TestSplit);
+    RUN_TEST(TestField);
+    RUN_TEST(TestQuoteRoundTrip);
+    RUN_TEST(TestReadRecord);
+    RUN_TEST(TestUnterminatedQuote);
+    RUN_TEST(TestChunkBoundaries);
+    return 0;
+}
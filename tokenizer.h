@@ -0,0 +1,371 @@
+#ifndef _CSV_TOKENIZER_
+#define _CSV_TOKENIZER_
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <iostream>
+#include <cstdlib>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+
+using namespace std;
+namespace csv { namespace util {
+
+// RFC 4180 tokenizer.
+// A field may be quoted, a quoted field may hold delimiters,
+// newlines, and quotes escaped by doubling them ("").
+// The input is classified 64 bytes at a time into bitmasks
+// of quote, delimiter and newline positions. A byte is inside
+// quotes when an odd number of quotes precede it, i.e. the
+// quoted regions are the prefix XOR of the quote mask, so
+// delimiters and newlines in quotes are masked out without a
+// branch per byte. An escaped quote toggles twice and needs
+// no special case.
+
+// A field as it appears in the input, quotes included.
+struct Slice {
+    const char* data;
+    size_t size;
+};
+
+struct BlockMasks {
+    uint64_t quote;
+    uint64_t delimiter;
+    uint64_t newline;
+};
+
+// Bit i of the result is the XOR of bits 0..i.
+inline uint64_t PrefixXor (uint64_t bits) {
+#ifdef __PCLMUL__
+    // Carry-less multiply by all ones.
+    return _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_set_epi64x(0, bits),
+                                                  _mm_set1_epi8(static_cast<char>(0xFF)), 0));
+#else
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+#endif
+}
+
+inline int CountTrailingZeros (uint64_t bits) {
+    return __builtin_ctzll(bits);
+}
+
+// Run fn(0) .. fn(n - 1), each on its own thread.
+template <typename Fn>
+void RunParallel (size_t n, Fn fn) {
+    vector<thread> threads;
+    for (size_t i = 1; i < n; ++i) {
+        threads.push_back(thread(fn, i));
+    }
+    if (n > 0) {
+        fn(0);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+struct Tokenizer {
+    static const size_t kBlockSize = 64;
+
+    Tokenizer (char delimiter = ',', char quote = '"')
+        : delimiter_(delimiter), quote_(quote)
+    {}
+
+    char GetDelimiter() const {
+        return delimiter_;
+    }
+
+    char GetQuote() const {
+        return quote_;
+    }
+
+    // Split one record into its fields, quotes kept.
+    // An empty record has no fields.
+    void Split (const char* data, size_t len, vector<Slice>& fields) const {
+        fields.clear();
+        if (len == 0) {
+            return;
+        }
+
+        uint64_t in_quotes = 0;
+        size_t field_start = 0;
+        for (size_t block = 0; block < len; block += kBlockSize) {
+            BlockMasks masks;
+            Classify(data + block, BlockLength(len, block), masks);
+            uint64_t separators = masks.delimiter & ~QuotedMask(masks.quote, in_quotes);
+            while (separators) {
+                size_t pos = block + CountTrailingZeros(separators);
+                Slice field = {data + field_start, pos - field_start};
+                fields.push_back(field);
+                field_start = pos + 1;
+                separators &= separators - 1;
+            }
+        }
+
+        Slice field = {data + field_start, len - field_start};
+        fields.push_back(field);
+    }
+
+    // The col_index'th field of a record, without splitting
+    // the rest of it. Empty if the record is shorter.
+    Slice Field (const char* data, size_t len, size_t col_index) const {
+        uint64_t in_quotes = 0;
+        size_t field_start = 0;
+        size_t field_index = 0;
+        for (size_t block = 0; block < len; block += kBlockSize) {
+            BlockMasks masks;
+            Classify(data + block, BlockLength(len, block), masks);
+            uint64_t separators = masks.delimiter & ~QuotedMask(masks.quote, in_quotes);
+            while (separators) {
+                size_t pos = block + CountTrailingZeros(separators);
+                if (field_index == col_index) {
+                    Slice field = {data + field_start, pos - field_start};
+                    return field;
+                }
+                field_index++;
+                field_start = pos + 1;
+                separators &= separators - 1;
+            }
+        }
+
+        Slice field = {data + field_start, (field_index == col_index) ? len - field_start : 0};
+        return field;
+    }
+
+    // Text of a field, surrounding quotes removed
+    // and doubled quotes collapsed.
+    string Unquote (const Slice& field) const {
+        if (field.size < 2 || field.data[0] != quote_) {
+            return string(field.data, field.size);
+        }
+
+        string text;
+        text.reserve(field.size);
+        const char* end = field.data + field.size;
+        for (const char* p = field.data + 1; p < end; ++p) {
+            if (*p == quote_) {
+                if (p + 1 < end && p[1] == quote_) {
+                    ++p;
+                } else {
+                    // Closing quote, keep what follows
+                    // it as is.
+                    text.append(p + 1, end);
+                    break;
+                }
+            }
+            text.push_back(*p);
+        }
+        return text;
+    }
+
+    // Read a record, joining lines while a quoted field is
+    // open, which the quote mask tells as for ChunkBoundaries.
+    // The \r of a CRLF record end is dropped, blank lines are
+    // skipped. A quoted field still open at the end of the
+    // input is an error.
+    bool ReadRecord (istream& str, string& record) const {
+        do {
+            if (!std::getline(str, record)) {
+                return false;
+            }
+
+            uint64_t quoted = 0;
+            size_t scanned = 0;
+            record.push_back('\n');
+            while (ScanRecordEnd(record.data() + scanned, record.size() - scanned, quoted) == string::npos) {
+                // The newline is in quotes.
+                scanned = record.size();
+                string line;
+                if (!std::getline(str, line)) {
+                    UnterminatedQuote(record.data(), record.size());
+                }
+                record += line;
+                record.push_back('\n');
+            }
+            record.pop_back();
+
+            if (!record.empty() && record.back() == '\r') {
+                record.pop_back();
+            }
+        } while (record.empty());
+        return true;
+    }
+
+    // Field text as written to the output, quoted when it
+    // holds the delimiter, a quote or a line break.
+    string Quote (const string& text) const {
+        if (text.find_first_of(string(1, delimiter_) + quote_ + "\r\n") == string::npos) {
+            return text;
+        }
+
+        string quoted(1, quote_);
+        for (auto &c : text) {
+            if (c == quote_) {
+                quoted.push_back(quote_);
+            }
+            quoted.push_back(c);
+        }
+        quoted.push_back(quote_);
+        return quoted;
+    }
+
+    // Offset just past the newline ending the record which
+    // starts at data, len if the record is not complete.
+    // in_quotes - data starts inside a quoted field.
+    size_t FindRecordEnd (const char* data, size_t len, bool in_quotes = false) const {
+        uint64_t quoted = in_quotes ? ~0ULL : 0;
+        size_t end = ScanRecordEnd(data, len, quoted);
+        return (end == string::npos) ? len : end;
+    }
+
+    // Offset just past the first newline outside quotes, npos
+    // if there is none. quoted carries the quote state from one
+    // call to the next (start with 0) and is left as it is at
+    // the end of data when npos is returned.
+    size_t ScanRecordEnd (const char* data, size_t len, uint64_t& quoted) const {
+        for (size_t block = 0; block < len; block += kBlockSize) {
+            BlockMasks masks;
+            Classify(data + block, BlockLength(len, block), masks);
+            uint64_t newlines = masks.newline & ~QuotedMask(masks.quote, quoted);
+            if (newlines) {
+                quoted = 0;
+                return block + CountTrailingZeros(newlines) + 1;
+            }
+        }
+        return string::npos;
+    }
+
+    // Cut data into at most num_chunks ranges starting on record
+    // boundaries, for parsing them in parallel. Returns the
+    // range starts followed by len. Exits if data ends inside
+    // a quoted field.
+    // Where a chunk starts can not be told locally, a newline
+    // may be in quotes. One parallel pass counts the quotes of
+    // every chunk, which gives the quote state at each chunk
+    // start, and a second finds the first record end after it.
+    vector<size_t> ChunkBoundaries (const char* data, size_t len, size_t num_chunks) const {
+        num_chunks = std::max<size_t>(1, std::min(num_chunks, len / kBlockSize + 1));
+        vector<size_t> nominal(num_chunks + 1);
+        for (size_t i = 0; i <= num_chunks; ++i) {
+            nominal[i] = len * i / num_chunks;
+        }
+
+        vector<size_t> quotes(num_chunks, 0);
+        RunParallel(num_chunks, [&](size_t i) {
+            quotes[i] = std::count(data + nominal[i], data + nominal[i + 1], quote_);
+        });
+
+        vector<bool> starts_in_quotes(num_chunks, false);
+        for (size_t i = 1; i < num_chunks; ++i) {
+            starts_in_quotes[i] = starts_in_quotes[i - 1] ^ (quotes[i - 1] & 1);
+        }
+        if (starts_in_quotes[num_chunks - 1] ^ (quotes[num_chunks - 1] & 1)) {
+            UnterminatedQuote(data, len);
+        }
+
+        vector<size_t> starts(num_chunks, 0);
+        RunParallel(num_chunks, [&](size_t i) {
+            if (i > 0) {
+                starts[i] = nominal[i] + FindRecordEnd(data + nominal[i], len - nominal[i],
+                                                       starts_in_quotes[i]);
+            }
+        });
+
+        vector<size_t> boundaries;
+        for (auto &start : starts) {
+            if (boundaries.empty() || start > boundaries.back()) {
+                boundaries.push_back(start);
+            }
+        }
+        if (boundaries.back() != len) {
+            boundaries.push_back(len);
+        }
+        return boundaries;
+    }
+
+private:
+    // data holds a quoted field never closed.
+    [[noreturn]] void UnterminatedQuote (const char* data, size_t len) const {
+        size_t start = 0;
+        uint64_t quoted = 0;
+        size_t end;
+        // Report the record the open quote is in.
+        while ((end = ScanRecordEnd(data + start, len - start, quoted)) != string::npos) {
+            start += end;
+        }
+        cerr << "Unterminated quoted field in the record starting with: "
+             << string(data + start, std::min<size_t>(len - start, 40)) << "\n";
+        exit(0);
+    }
+
+    static size_t BlockLength (size_t len, size_t block) {
+        return (len - block < kBlockSize) ? len - block : kBlockSize;
+    }
+
+    // Bits inside quotes for this block. in_quotes carries
+    // the state across blocks, all ones or all zeros.
+    static uint64_t QuotedMask (uint64_t quote_bits, uint64_t& in_quotes) {
+        uint64_t quoted = PrefixXor(quote_bits) ^ in_quotes;
+        in_quotes = static_cast<uint64_t>(static_cast<int64_t>(quoted) >> 63);
+        return quoted;
+    }
+
+    void Classify (const char* p, size_t len, BlockMasks& masks) const {
+#ifdef __SSE2__
+        if (len < kBlockSize) {
+            // Short block, classify a zero padded copy. Padding
+            // never matches, as long as none of the characters
+            // is NUL.
+            char block[kBlockSize];
+            memset(block, 0, sizeof(block));
+            memcpy(block, p, len);
+            Classify(block, kBlockSize, masks);
+            return;
+        }
+
+        const __m128i quote = _mm_set1_epi8(quote_);
+        const __m128i delimiter = _mm_set1_epi8(delimiter_);
+        const __m128i newline = _mm_set1_epi8('\n');
+        masks.quote = masks.delimiter = masks.newline = 0;
+        for (size_t i = 0; i < kBlockSize; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            masks.quote |= static_cast<uint64_t>(static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, quote)))) << i;
+            masks.delimiter |= static_cast<uint64_t>(static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, delimiter)))) << i;
+            masks.newline |= static_cast<uint64_t>(static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)))) << i;
+        }
+#else
+        masks.quote = masks.delimiter = masks.newline = 0;
+        for (size_t i = 0; i < len; ++i) {
+            uint64_t bit = 1ULL << i;
+            masks.quote |= (p[i] == quote_) ? bit : 0;
+            masks.delimiter |= (p[i] == delimiter_) ? bit : 0;
+            masks.newline |= (p[i] == '\n') ? bit : 0;
+        }
+#endif
+    }
+
+    char delimiter_;
+    char quote_;
+};
+
+} } //namespace
+
+#endif
@@ -9,7 +9,17 @@
 #include <sstream> 
 #include <vector>
 #include <stdio.h>
+#include <stdint.h>
+#include <cstring>
 #include <cassert>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "tokenizer.h"
 
 using namespace std;
 namespace csv { namespace util {
@@ -19,26 +29,543 @@ bool invalidChar (char c)
     return !isprint((unsigned)c); 
 }
  
-// Split into vector of strings
+// Cell as int, same as atoi but bounded by end
+// instead of a terminating NUL.
+int ParseInt(const char* p, const char* end) {
+    while (p != end && isspace(static_cast<unsigned char>(*p))) {
+        ++p;
+    }
+
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        ++p;
+    }
+
+    unsigned int value = 0;
+    while (p != end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        ++p;
+    }
+    return static_cast<int>(negative ? 0 - value : value);
+}
+
+int ParseInt(const Slice& field, const Tokenizer& tokenizer) {
+    if (field.size && field.data[0] == tokenizer.GetQuote()) {
+        string text = tokenizer.Unquote(field);
+        return ParseInt(text.data(), text.data() + text.size());
+    }
+    return ParseInt(field.data, field.data + field.size);
+}
+
+// Split into vector of ints
 void split(const string& str, char delimiter, vector<int>& res) {
-   stringstream ss(str); // Turn the string into a stream.
-   string tok;
-   while(getline(ss, tok, delimiter)) {
-      tok.erase(remove_if(tok.begin(),tok.end(), invalidChar), tok.end());
-      res.push_back(atoi(tok.c_str())); // This should be a templated method XXX HACK TODO
+   Tokenizer tokenizer(delimiter);
+   vector<Slice> fields;
+   tokenizer.Split(str.data(), str.size(), fields);
+   for (auto &field : fields) {
+      res.push_back(ParseInt(field, tokenizer));
    }
 }
 
-// Split into vector of ints
+// Split into vector of strings
 void split(const string& str, char delimiter, vector<string>& res) {
-   stringstream ss(str); // Turn the string into a stream.
-   string tok;
-   while(getline(ss, tok, delimiter)) {
+   Tokenizer tokenizer(delimiter);
+   vector<Slice> fields;
+   tokenizer.Split(str.data(), str.size(), fields);
+   for (auto &field : fields) {
+      string tok = tokenizer.Unquote(field);
       tok.erase(remove_if(tok.begin(),tok.end(), invalidChar), tok.end());
-      res.push_back(tok); // This should be a templated method XXX HACK TODO
+      res.push_back(tok);
    }
 }
 
+// Split a binary column expression, ex: A+B, into its
+// operator and the two column names. The operator is
+// searched in the order + - * /
+// Returns false when there is no operator.
+bool SplitExpression (const string& expression, char& oper, vector<string>& operands) {
+    const char operators[] = {'+', '-', '*', '/'};
+    for (auto &op : operators) {
+        if (expression.find(op) != string::npos) {
+            oper = op;
+            split(expression, op, operands);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 64 bit finalizer (murmur3 fmix64), good enough
+// to spread consecutive integer keys.
+uint64_t HashInt(int64_t key) {
+    uint64_t h = static_cast<uint64_t>(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// FNV-1a over a byte range.
+uint64_t HashBytes(const char* data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Fast 64 bit hash for join keys, 8 bytes at a time with
+// multiply-xorshift mixing.
+uint64_t HashKey(const char* data, size_t len) {
+    const uint64_t kMul = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = len * kMul;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * kMul;
+        h ^= h >> 29;
+    }
+
+    uint64_t tail = 0;
+    if (i < len) {
+        memcpy(&tail, data + i, len - i);
+    }
+    h = (h ^ tail) * kMul;
+    return HashInt(static_cast<int64_t>(h));
+}
+
+// Size of the file in bytes, -1 if it can not be stat'ed.
+int64_t FileSize(const string& file_name) {
+    struct stat st;
+    if (stat(file_name.c_str(), &st) != 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+// Offset just past the last newline of the file, looking
+// no further back than min_offset. Everything after it is a
+// record still being appended.
+int64_t LastRecordEnd(const string& file_name, int64_t min_offset) {
+    ifstream file(file_name.c_str(), std::ifstream::in | std::ifstream::binary);
+    int64_t pos = FileSize(file_name);
+    char buf[64 * 1024];
+    while (file.is_open() && pos > min_offset) {
+        int64_t len = std::min<int64_t>(sizeof(buf), pos - min_offset);
+        file.seekg(pos - len);
+        if (!file.read(buf, len)) {
+            break;
+        }
+        for (int64_t i = len - 1; i >= 0; --i) {
+            if (buf[i] == '\n') {
+                return pos - len + i + 1;
+            }
+        }
+        pos -= len;
+    }
+    return min_offset;
+}
+
+// Read only memory map of a whole file.
+struct MappedFile {
+    MappedFile (const string& file_name)
+        : data_(nullptr), size_(0), is_open_(false) {
+        int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            size_ = st.st_size;
+            is_open_ = true;
+            if (size_ > 0) {
+                void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    size_ = 0;
+                    is_open_ = false;
+                } else {
+                    data_ = static_cast<const char*>(data);
+                    madvise(data, size_, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile () {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    MappedFile (const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool IsOpen() const {
+        return is_open_;
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+    bool is_open_;
+};
+
+// Read at most limit bytes from another stream buffer,
+// counting the lines that went through.
+struct LimitedStreamBuf : public std::streambuf {
+    LimitedStreamBuf (std::streambuf* source, uint64_t limit)
+        : source_(source), remaining_(limit), lines_(0)
+    {}
+
+    uint64_t GetLines() const {
+        return lines_;
+    }
+
+protected:
+    int_type underflow() {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        std::streamsize len = source_->sgetn(buf_, std::min<uint64_t>(sizeof(buf_), remaining_));
+        if (len <= 0) {
+            return traits_type::eof();
+        }
+        remaining_ -= len;
+        lines_ += std::count(buf_, buf_ + len, '\n');
+        setg(buf_, buf_, buf_ + len);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    std::streambuf* source_;
+    uint64_t remaining_;
+    uint64_t lines_;
+    char buf_[64 * 1024];
+};
+
+// Progress of incremental runs over an append-only input.
+// Saved after every run, the next run only reads what was
+// appended past offset and appends to the output.
+struct Checkpoint {
+    Checkpoint ()
+        : fingerprint(0), offset(0), rows(0), output_size(0), header_written(false),
+          delimiter(','), has_header(false)
+    {}
+
+    static const int64_t kFingerprintBytes = 4096;
+
+    // Hash of the bytes around what a run consumed, the start
+    // of the file and the bytes just before offset (the last
+    // records read). A file rewritten or rotated since, even
+    // with the same header, does not resume from an old
+    // checkpoint.
+    static uint64_t Fingerprint (const string& file_name, uint64_t offset) {
+        ifstream file(file_name.c_str(), std::ifstream::binary);
+        int64_t max_bytes = kFingerprintBytes;
+        int64_t head_size = std::min<int64_t>(offset, max_bytes);
+        int64_t tail_size = std::min<int64_t>(offset - head_size, max_bytes);
+        string bytes(head_size + tail_size, '\0');
+        file.read(&bytes[0], head_size);
+        file.seekg(offset - tail_size);
+        file.read(&bytes[head_size], tail_size);
+        if (!file) {
+            return 0; // shorter than offset
+        }
+        return HashBytes(bytes.data(), bytes.size()) ^ HashInt(static_cast<int64_t>(offset));
+    }
+
+    // Same command as the one that saved the checkpoint.
+    bool SameRun (const Checkpoint& other) const {
+        return input_file == other.input_file &&
+               output_file == other.output_file &&
+               expression == other.expression &&
+               filter == other.filter &&
+               delimiter == other.delimiter &&
+               has_header == other.has_header;
+    }
+
+    bool Load (const string& file_name) {
+        ifstream file(file_name.c_str(), std::ifstream::in);
+        if (!file.is_open()) {
+            return false;
+        }
+
+        string line;
+        while (std::getline(file, line)) {
+            size_t eq = line.find('=');
+            if (eq == string::npos) {
+                continue;
+            }
+            string key = line.substr(0, eq);
+            string value = line.substr(eq + 1);
+            if (key == "input") {
+                input_file = value;
+            } else if (key == "fingerprint") {
+                fingerprint = strtoull(value.c_str(), nullptr, 10);
+            } else if (key == "offset") {
+                offset = strtoull(value.c_str(), nullptr, 10);
+            } else if (key == "rows") {
+                rows = strtoull(value.c_str(), nullptr, 10);
+            } else if (key == "output_size") {
+                output_size = strtoull(value.c_str(), nullptr, 10);
+            } else if (key == "header_written") {
+                header_written = (value == "1");
+            } else if (key == "output") {
+                output_file = value;
+            } else if (key == "expression") {
+                expression = value;
+            } else if (key == "filter") {
+                filter = value;
+            } else if (key == "delimiter") {
+                delimiter = static_cast<char>(atoi(value.c_str()));
+            } else if (key == "has_header") {
+                has_header = (value == "1");
+            }
+        }
+        return !input_file.empty();
+    }
+
+    // Written aside and renamed, a crash never leaves a
+    // half written checkpoint behind.
+    void Save (const string& file_name) const {
+        string tmp_name = file_name + ".tmp";
+        {
+            ofstream file(tmp_name.c_str());
+            file << "input=" << input_file << "\n"
+                 << "fingerprint=" << fingerprint << "\n"
+                 << "offset=" << offset << "\n"
+                 << "rows=" << rows << "\n"
+                 << "output_size=" << output_size << "\n"
+                 << "header_written=" << (header_written ? 1 : 0) << "\n"
+                 << "output=" << output_file << "\n"
+                 << "expression=" << expression << "\n"
+                 << "filter=" << filter << "\n"
+                 << "delimiter=" << static_cast<int>(delimiter) << "\n"
+                 << "has_header=" << (has_header ? 1 : 0) << "\n";
+        }
+        rename(tmp_name.c_str(), file_name.c_str());
+    }
+
+    string input_file;
+    uint64_t fingerprint;
+    uint64_t offset;        // input bytes consumed
+    uint64_t rows;          // records processed so far
+    uint64_t output_size;   // output bytes belonging to those records
+    bool header_written;
+
+    // The command, a checkpoint only resumes the same one.
+    string output_file;
+    string expression;
+    string filter;
+    char delimiter;
+    bool has_header;
+};
+
+// Blocked (split block) Bloom filter.
+// Every key maps to one 32 byte block, eight 32 bit words,
+// and sets one bit in each word. Blocks are aligned so none
+// straddles two cache lines.
+// The upper half of the hash picks the block, the lower half
+// the bits, so a probe is one cache miss and eight independent
+// AND tests which AVX2 does in one go.
+struct BloomFilter {
+    static const size_t kWordsPerBlock = 8;
+    static const size_t kBitsPerKey = 16;
+    static const size_t kBitsPerBlock = kWordsPerBlock * 32;
+
+    BloomFilter (size_t expected_keys = 0) {
+        Reset(expected_keys);
+    }
+
+    // blocks_ points into storage_, moving keeps the
+    // buffer, copying would not.
+    BloomFilter (const BloomFilter&) = delete;
+    BloomFilter& operator=(const BloomFilter&) = delete;
+    BloomFilter (BloomFilter&&) = default;
+    BloomFilter& operator=(BloomFilter&&) = default;
+
+    // Drop all keys, size for expected_keys.
+    void Reset (size_t expected_keys) {
+        num_blocks_ = (expected_keys * kBitsPerKey + kBitsPerBlock - 1) / kBitsPerBlock;
+        if (num_blocks_ == 0) {
+            num_blocks_ = 1;
+        }
+        // Over allocate a cache line so the first block
+        // can be aligned on one, up to 60 bytes in.
+        storage_.assign(num_blocks_ * kWordsPerBlock + 64 / sizeof(uint32_t), 0);
+        size_t misalign = reinterpret_cast<uintptr_t>(storage_.data()) % 64;
+        blocks_ = storage_.data() + (misalign ? (64 - misalign) / sizeof(uint32_t) : 0);
+    }
+
+    void Add (uint64_t hash) {
+        uint32_t* block = Block(hash);
+        uint32_t mask[kWordsPerBlock];
+        MakeMask(static_cast<uint32_t>(hash), mask);
+        for (size_t i = 0; i < kWordsPerBlock; ++i) {
+            block[i] |= mask[i];
+        }
+    }
+
+    // false - key was never added
+    // true  - key was probably added
+    bool MayContain (uint64_t hash) const {
+        const uint32_t* block = Block(hash);
+#ifdef __AVX2__
+        const __m256i salt = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Salt()));
+        __m256i bits = _mm256_mullo_epi32(_mm256_set1_epi32(static_cast<uint32_t>(hash)), salt);
+        bits = _mm256_srli_epi32(bits, 27);
+        __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+        __m256i words = _mm256_load_si256(reinterpret_cast<const __m256i*>(block));
+        return _mm256_testc_si256(words, mask);
+#else
+        uint32_t mask[kWordsPerBlock];
+        MakeMask(static_cast<uint32_t>(hash), mask);
+        // No early exit, the compiler vectorizes this loop.
+        uint32_t missing = 0;
+        for (size_t i = 0; i < kWordsPerBlock; ++i) {
+            missing |= mask[i] & ~block[i];
+        }
+        return missing == 0;
+#endif
+    }
+
+private:
+    static const uint32_t* Salt() {
+        static const uint32_t salt[kWordsPerBlock] = {
+            0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+            0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+        return salt;
+    }
+
+    static void MakeMask (uint32_t key, uint32_t* mask) {
+        const uint32_t* salt = Salt();
+        for (size_t i = 0; i < kWordsPerBlock; ++i) {
+            mask[i] = 1U << ((key * salt[i]) >> 27);
+        }
+    }
+
+    uint32_t* Block (uint64_t hash) {
+        return blocks_ + BlockIndex(hash) * kWordsPerBlock;
+    }
+
+    const uint32_t* Block (uint64_t hash) const {
+        return blocks_ + BlockIndex(hash) * kWordsPerBlock;
+    }
+
+    // Multiply-shift instead of modulo, num_blocks_ need
+    // not be a power of 2.
+    size_t BlockIndex (uint64_t hash) const {
+        return static_cast<size_t>(((hash >> 32) * num_blocks_) >> 32);
+    }
+
+    vector<uint32_t> storage_;
+    uint32_t* blocks_;
+    size_t num_blocks_;
+};
+
+// Dictionary encoding of string keys to dense ids 0, 1, 2...
+// Open addressing with linear probing. A slot holds the
+// key's cached hash and id, the key bytes sit back to back in
+// an arena, so probes compare hashes and touch the key bytes
+// only on a hash match, and growing never rehashes a key.
+struct KeyDictionary {
+    static const int kNotFound = -1;
+
+    KeyDictionary ()
+        : slots_(16), mask_(15)
+    {}
+
+    size_t Size() const {
+        return keys_.size();
+    }
+
+    // Id of the key, a new one if it was not there.
+    int Encode (const char* key, size_t len, uint64_t hash) {
+        size_t slot = Probe(key, len, hash);
+        if (slots_[slot].id != 0) {
+            return slots_[slot].id - 1;
+        }
+
+        slots_[slot].hash = hash;
+        slots_[slot].id = keys_.size() + 1;
+        keys_.push_back(make_pair(arena_.size(), len));
+        arena_.append(key, len);
+
+        // Keep the load under a half.
+        if (keys_.size() * 2 > slots_.size()) {
+            Grow();
+        }
+        return keys_.size() - 1;
+    }
+
+    // Id of the key, kNotFound if it is not there.
+    int Find (const char* key, size_t len, uint64_t hash) const {
+        return static_cast<int>(slots_[Probe(key, len, hash)].id) - 1;
+    }
+
+private:
+    struct Slot {
+        Slot () : hash(0), id(0)
+        {}
+
+        uint64_t hash;
+        uint32_t id;    // id + 1, 0 is an empty slot
+    };
+
+    // Slot holding the key, or the empty slot it would go in.
+    size_t Probe (const char* key, size_t len, uint64_t hash) const {
+        for (size_t slot = hash & mask_;; slot = (slot + 1) & mask_) {
+            const Slot& s = slots_[slot];
+            if (s.id == 0) {
+                return slot;
+            }
+
+            if (s.hash == hash) {
+                const pair<size_t, size_t>& k = keys_[s.id - 1];
+                if (k.second == len && memcmp(arena_.data() + k.first, key, len) == 0) {
+                    return slot;
+                }
+            }
+        }
+    }
+
+    void Grow () {
+        vector<Slot> old_slots(slots_.size() * 2);
+        old_slots.swap(slots_);
+        mask_ = slots_.size() - 1;
+        for (auto &s : old_slots) {
+            if (s.id != 0) {
+                size_t slot = s.hash & mask_;
+                while (slots_[slot].id != 0) {
+                    slot = (slot + 1) & mask_;
+                }
+                slots_[slot] = s;
+            }
+        }
+    }
+
+    vector<Slot> slots_;
+    size_t mask_;
+    string arena_;
+    vector<pair<size_t, size_t>> keys_;     // offset, size in arena_
+};
+
 // Vector of strings representing
 // the column names allowed through
 // the filter..
@@ -74,11 +601,10 @@ private:
 // If there is no header defined, default column names are assigned
 struct Header {
 
-    void set (const std::string header_str) {
+    void set (const std::string header_str, char delimiter = ',') {
         vector<string> header;
-        std::stringstream ss(header_str);
 
-        split(header_str, ',', header);
+        split(header_str, delimiter, header);
         for (auto &i: header) {
             i.erase(remove_if(i.begin(),i.end(), invalidChar), i.end()); 
             header_.push_back(make_pair(i,true));
@@ -87,14 +613,14 @@ struct Header {
     
     // Create a header with default column names in the format
     // col_<index>
-    void MakeHeader (const string& file_name) {
+    void MakeHeader (const string& file_name, char delimiter = ',') {
         std::ifstream csv_file(file_name.c_str(), std::ifstream::in);
         if (csv_file.is_open()) {
           string record;
-          std::getline(csv_file, record);
+          Tokenizer(delimiter).ReadRecord(csv_file, record);
        
           vector<string> header;
-          split(record, ',', header);
+          split(record, delimiter, header);
           vector<string>::iterator iter = header.begin();
           for (;iter != header.end(); ++iter) {
               int col_index = std::distance (header.begin(), iter);
@@ -107,6 +633,22 @@ struct Header {
         }
     }
 
+    // Column names from the first record of the stream
+    // if has_header, default names otherwise.
+    void Read (std::istream& csv_file, const string& file_name,
+               bool has_header, char delimiter = ',') {
+        if (has_header) {
+            string header_str;
+            // Get the header line
+            Tokenizer(delimiter).ReadRecord(csv_file, header_str);
+            set (header_str, delimiter);
+        } else {
+            // No column header defined
+            // Generate default col names
+            MakeHeader (file_name, delimiter);
+        }
+    }
+
     // mark columns according to the filter definition
     void ApplyFilter (SimpleStringFilter& filter) {
        vector<pair<string,bool>>::iterator iter_hdr = header_.begin();
@@ -137,7 +679,7 @@ struct Header {
     }
 
     const std::string GetColumnName(const size_t& col_index) {
-        if (col_index >= GetNumCols()){
+        if (col_index >= static_cast<size_t>(GetNumCols())){
             return std::string();
         }
 
@@ -161,7 +703,7 @@ struct Header {
         for (auto &i:header_) {
            pair<string, bool> column = i;
            if (column.second){
-               str << column.first << "," ;
+               str << Tokenizer().Quote(column.first) << "," ;
            }
         }
 
@@ -180,7 +722,7 @@ struct Header {
     // Specify the col_index instead of name
     // since there can be duplicat col names.e
     void MarkColumnFilter (const int col_index) {
-        assert (col_index <= header_.size());
+        assert (static_cast<size_t>(col_index) <= header_.size());
 
         header_[col_index].second = false;
     }
@@ -212,6 +754,8 @@ struct CSVRecord
        header_(header), filter_(filter)
     {}
 
+   CSVRecord (const CSVRecord&) = default;
+
    // Getters
    T const& operator[](std::size_t index) const {
        return data_[index].first;
@@ -233,18 +777,26 @@ struct CSVRecord
    // stream, construct the row
    void NextRecord (std::istream& str) {
        std::string line;
-       std::getline(str,line);
+       Tokenizer(delimiter_).ReadRecord(str,line);
+       ParseRecord(line);
+   }
 
-       std::stringstream lineStream(line);
-       std::string cell_str;
+   // construct the row from an already read record
+   void ParseRecord (const std::string& line) {
+       Tokenizer tokenizer(delimiter_);
+       tokenizer.Split(line.data(), line.size(), fields_);
 
        data_.clear();
 
-       while(std::getline(lineStream,cell_str,',')) {
-           data_.push_back(make_pair(atoi(cell_str.c_str()),true));
+       for (auto &field : fields_) {
+           data_.push_back(make_pair(ParseInt(field, tokenizer),true));
        }
    }
 
+   void SetDelimiter (char delimiter) {
+       delimiter_ = delimiter;
+   }
+
   // Copy incoming row into this row
   CSVRecord& operator=(CSVRecord rhs) {
       if (this != &rhs) {
@@ -372,7 +924,7 @@ struct CSVRecord
    // True = Can eb displayed
    // False = Can NOT be displayed
    void MarkColumnFilter (const int col_index) {
-       assert (col_index <= data_.size());
+       assert (static_cast<size_t>(col_index) <= data_.size());
 
        data_[col_index].second = false;
    }
@@ -387,6 +939,8 @@ private:
    std::vector<pair<T,bool>> data_;
    Header header_;
    SimpleStringFilter filter_;
+   char delimiter_ = ',';
+   std::vector<Slice> fields_;
 };
 
 